@@ -0,0 +1,275 @@
+// bench.cpp
+// Reproducible benchmark for the plan pipeline. Replays a profile corpus through
+// core::generatePlanStream (the generatePlan path plus a first-piece hook for
+// TTFT) and times the CPU-only stages in isolation. Prints one JSON object.
+//
+//   workout_bench <model.gguf> [--corpus FILE] [--runs N] [--warmup N] [--max-tokens N]
+//                 [--ctx N] [--gpu-layers N|all|auto] [--tensor-split 3,1] [--threads N] [--seed S]
+//                 [--no-grammar]
+//   workout_bench --micro-only
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi")
+#else
+#include <sys/resource.h>
+#endif
+
+#include "CoreFacade.h"
+#include "Domain.h"
+#include "JsonUtil.h"
+#include "Metrics.h"
+#include "Prompt.h"
+#include "Sampler.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double ms_since(Clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+}
+
+static long peak_rss_kb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return (long)(pmc.PeakWorkingSetSize / 1024);
+    return 0;
+#else
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;   // bytes on macOS
+#else
+    return ru.ru_maxrss;
+#endif
+#endif
+}
+
+// Nearest-rank percentile over a sorted sample.
+static double pct(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t i = (size_t)(p / 100.0 * (double)sorted.size() + 0.5);
+    i = std::min(std::max<size_t>(i, 1), sorted.size());
+    return sorted[i - 1];
+}
+
+static std::string summary(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    double sum = 0.0;
+    for (double x : v) sum += x;
+    char buf[192];
+    std::snprintf(buf, sizeof(buf), "{\"mean\":%.3f,\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+                  v.empty() ? 0.0 : sum / (double)v.size(), pct(v, 50), pct(v, 95), pct(v, 99),
+                  v.empty() ? 0.0 : v.back());
+    return buf;
+}
+
+static const char* const kDefaultGoals[] = {
+    "5K under 25:00", "First 10K", "Half marathon in 1:50", "Marathon under 4 hours",
+    "Get back to running after a knee injury", "Run 3 times a week consistently",
+};
+
+// One request per line: a profile object or a bare goal, like --serve input.
+static std::vector<std::string> load_corpus(const std::string& path) {
+    std::vector<std::string> out;
+    if (path.empty()) {
+        for (const char* g : kDefaultGoals) out.push_back(prompt::minimalProfile(g));
+        return out;
+    }
+    std::ifstream in(path);
+    if (!in) { std::cerr << "[bench] cannot open corpus " << path << "\n"; return out; }
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t l = line.find_first_not_of(" \t\r");
+        if (l == std::string::npos || line[l] == '#') continue;
+        size_t r = line.find_last_not_of(" \t\r");
+        std::string s = line.substr(l, r - l + 1);
+        out.push_back(s[0] == '{' ? s : prompt::minimalProfile(s));
+    }
+    return out;
+}
+
+// ---- microbenchmarks --------------------------------------------------------
+
+template <class F>
+static double ns_per_op(int iters, F&& f) {
+    double best = 1e30;
+    for (int rep = 0; rep < 5; ++rep) {
+        const auto t0 = Clock::now();
+        for (int i = 0; i < iters; ++i) f();
+        const double ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / iters;
+        best = std::min(best, ns);
+    }
+    return best;
+}
+
+static std::string sample_plan(int weeks) {
+    std::string p = "{\"goal\":\"Half marathon in 1:50\",\"weeks\":[";
+    for (int w = 1; w <= weeks; ++w) {
+        char buf[320];
+        std::snprintf(buf, sizeof(buf),
+                      "%s{\"week\":%d,\"sessions\":[\"Mon: rest\",\"Tue: easy run %d km\",\"Wed: 6x400m intervals\","
+                      "\"Thu: rest\",\"Fri: tempo run %d min\",\"Sat: long run %d km\",\"Sun: rest\"]}",
+                      w > 1 ? "," : "", w, 5 + w / 2, 20 + w, 10 + w);
+        p += buf;
+    }
+    p += "],\"rest_days\":[\"Mon\",\"Thu\",\"Sun\"]}";
+    return p;
+}
+
+static volatile size_t g_sink;   // keeps results observable
+
+static std::string run_micro() {
+    const std::string plan    = sample_plan(12);
+    const std::string raw     = "Sure! Here is your plan:\n```json\n" + plan + "\n```\nGood luck!";
+    const std::string cut     = raw.substr(0, raw.size() * 2 / 3);   // max_tokens truncation
+    const std::string profile = "{\"goal\":\"Half marathon\",\"injuries\":[\"knee\"]}";
+
+    const int n_vocab = 32000;
+    std::vector<float> logits(n_vocab);
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> nd(0.0f, 3.0f);
+    for (float& x : logits) x = nd(rng);
+
+    sampling::Params sp;
+    sp.temperature = 0.8f;
+    sp.seed        = 1234;
+    sampling::Sampler sampler(sp);
+    std::string tmp;
+
+    char buf[512];
+    std::snprintf(buf, sizeof(buf),
+                  "{\"extract_fenced_ns\":%.1f,\"extract_truncated_ns\":%.1f,\"parse_json_ns\":%.1f,"
+                  "\"check_and_fix_ns\":%.1f,\"argmax_32k_ns\":%.1f,\"sample_32k_ns\":%.1f,\"plan_bytes\":%zu}",
+                  ns_per_op(2000, [&] { jsonutil::extractFirstJson(raw, tmp); g_sink = tmp.size(); }),
+                  ns_per_op(2000, [&] { jsonutil::extractFirstJson(cut, tmp); g_sink = tmp.size(); }),
+                  ns_per_op(2000, [&] { g_sink = jsonutil::parseJson(plan); }),
+                  ns_per_op(1000, [&] { g_sink = domain::checkAndFixPlan(plan, profile).size(); }),
+                  ns_per_op(2000, [&] { g_sink = (size_t)sampling::argmax(logits.data(), n_vocab); }),
+                  ns_per_op(2000, [&] { g_sink = (size_t)sampler.sample(logits.data(), n_vocab); }),
+                  plan.size());
+    return buf;
+}
+
+// ---- end-to-end -------------------------------------------------------------
+
+int main(int argc, char** argv) {
+    std::string model_path, corpus_path;
+    int  runs = 3, warmup = 1;
+    bool micro_only = false;
+    bool grammar    = true;
+    core::Options opt;
+    opt.cache_entries = 0;   // every run must reach the model
+    lw::GenParams gp;
+    gp.max_tokens    = 2048;
+    gp.sampling.seed = 42;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a == "--micro-only") micro_only = true;
+        else if (a == "--no-grammar") grammar = false;
+        else if (a == "--corpus" && i + 1 < argc)     corpus_path       = argv[++i];
+        else if (a == "--runs" && i + 1 < argc)       runs              = std::max(1, std::atoi(argv[++i]));
+        else if (a == "--warmup" && i + 1 < argc)     warmup            = std::max(0, std::atoi(argv[++i]));
+        else if (a == "--max-tokens" && i + 1 < argc) gp.max_tokens     = std::max(1, std::atoi(argv[++i]));
+        else if (a == "--ctx" && i + 1 < argc)        opt.n_ctx         = std::atoi(argv[++i]);
+        else if (a == "--gpu-layers" && i + 1 < argc) {
+            if (!lw::parseGpuLayers(argv[++i], opt.n_gpu_layers)) {
+                std::cerr << "[bench] bad --gpu-layers value " << argv[i] << "\n"; return 2;
+            }
+        }
+        else if (a == "--tensor-split" && i + 1 < argc) opt.tensor_split = argv[++i];
+        else if (a == "--threads" && i + 1 < argc)    opt.n_threads     = std::atoi(argv[++i]);
+        else if (a == "--seed" && i + 1 < argc)       gp.sampling.seed  = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (model_path.empty() && a[0] != '-')   model_path        = a;
+        else { std::cerr << "[bench] unknown argument " << a << "\n"; return 2; }
+    }
+    if (!micro_only && model_path.empty()) {
+        std::cerr << "Usage: workout_bench <model.gguf> [--corpus FILE] [--runs N] [--warmup N] [--max-tokens N]\n"
+                     "                     [--ctx N] [--gpu-layers N|all|auto] [--tensor-split 3,1] [--threads N]\n"
+                     "                     [--seed S] [--no-grammar]\n"
+                     "       workout_bench --micro-only\n";
+        return 2;
+    }
+
+    const std::string micro = run_micro();
+    if (micro_only) {
+        std::cout << "{\"micro\":" << micro << ",\"peak_rss_kb\":" << peak_rss_kb() << "}\n";
+        return 0;
+    }
+
+    const std::vector<std::string> corpus = load_corpus(corpus_path);
+    if (corpus.empty()) return 1;
+
+    const auto t_load = Clock::now();
+    if (!core::init(model_path, opt)) { std::cerr << "[bench] init failed\n"; return 1; }
+    core::setConstrainedDecoding(grammar);
+    const double load_ms = ms_since(t_load);
+
+    std::vector<double> latency, ttft;
+    size_t n = 0, plan_ok = 0, raw_ok = 0, errors = 0;
+    std::string raw;
+    for (int pass = 0; pass < warmup + runs; ++pass) {
+        const bool measured = pass >= warmup;
+        if (pass == warmup) metrics::reset();   // stage totals cover measured passes only
+        for (const std::string& profile : corpus) {
+            raw.clear();
+            double first = -1.0;
+            const auto t0 = Clock::now();
+            core::StreamHandlers h;
+            h.on_piece = [&](const std::string& piece) {
+                if (first < 0.0) first = ms_since(t0);
+                raw += piece;
+                return true;
+            };
+            std::string plan;
+            try {
+                plan = core::generatePlanStream(profile, gp, h);
+            } catch (const std::exception& e) {
+                std::cerr << "[bench] " << e.what() << "\n";
+                if (measured) ++errors;
+                continue;
+            }
+            if (!measured) continue;
+            latency.push_back(ms_since(t0));
+            if (first >= 0.0) ttft.push_back(first);
+            ++n;
+            raw_ok  += jsonutil::looksLikeJson(raw);
+            plan_ok += jsonutil::looksLikeJson(plan) && plan.compare(0, 9, "{\"error\":") != 0;
+        }
+    }
+
+    const metrics::StageTotals prefill = metrics::stage(metrics::Stage::Prefill);
+    const metrics::StageTotals decode  = metrics::stage(metrics::Stage::Decode);
+    const uint64_t gen_tokens          = metrics::counter(metrics::Counter::GenTokens);
+    auto per_sec = [](uint64_t items, uint64_t ns) { return ns ? (double)items * 1e9 / (double)ns : 0.0; };
+
+    char buf[512];
+    std::snprintf(buf, sizeof(buf),
+                  "\"requests\":%zu,\"errors\":%zu,\"json_valid_rate\":%.4f,\"raw_json_valid_rate\":%.4f,"
+                  "\"prefill_tok_per_sec\":%.2f,\"decode_tok_per_sec\":%.2f,\"prompt_tokens\":%llu,"
+                  "\"gen_tokens\":%llu,\"kv_peak_cells\":%u,\"load_ms\":%.1f,\"peak_rss_kb\":%ld",
+                  n, errors, n ? (double)plan_ok / n : 0.0, n ? (double)raw_ok / n : 0.0,
+                  per_sec(prefill.items, prefill.total_ns), per_sec(gen_tokens, decode.total_ns),
+                  (unsigned long long)prefill.items, (unsigned long long)gen_tokens, metrics::kvPeak(), load_ms,
+                  peak_rss_kb());
+
+    std::cout << "{\"model\":\"" << jsonutil::escape(model_path) << "\",\"corpus\":" << corpus.size() << ",\"runs\":" << runs
+              << ",\"seed\":" << gp.sampling.seed << ",\"max_tokens\":" << gp.max_tokens
+              << ",\"grammar\":" << (grammar ? "true" : "false") << ",\"latency_ms\":" << summary(latency)
+              << ",\"ttft_ms\":" << summary(ttft) << "," << buf << ",\"micro\":" << micro
+              << ",\"stages\":" << metrics::toJson() << "}\n";
+
+    core::shutdown();
+    return errors ? 1 : 0;
+}
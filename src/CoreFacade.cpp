@@ -2,47 +2,786 @@
 // Orchestrates: buildPrompt -> lw::generate -> extractFirstJson -> domain check.
 
 #include <string>
+#include <vector>
 #include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <chrono>
 #include <iostream>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
-// ---- Forward decls (from other TUs) ----
-namespace lw {
-    bool        init(const std::string& model_path, int n_ctx, int n_gpu_layers);
-    std::string generate(const std::string& prompt, int max_tokens);
-    void        shutdown();
+#include "CoreFacade.h"
+#include "LlamaWrapper.h"
+#include "JsonUtil.h"
+#include "Domain.h"
+#include "PlanCache.h"
+#include "Metrics.h"
+#include "Prompt.h"
+
+// ---- Public facade API (C++ namespace) ----
+namespace core {
+
+// Everything tied to one loaded model: one shared model, n_contexts pooled
+// contexts; generate* may run on many threads. Each request holds the engine
+// it started on, so swapModel only redirects new work and the old engine goes
+// away with the last request still using it.
+struct Engine {
+    std::string                      path;
+    std::shared_ptr<lw::Model>       model;
+    std::shared_ptr<lw::Model>       draft;
+    std::unique_ptr<lw::ContextPool> pool;
+    prompt::Template                 tmpl;
+    uint64_t                         model_fp = 0;
+    std::string                      key_suffix;   // model identity + prompt/grammar text
+    std::atomic<bool>                constrained{false};
+    int                              kv_share = 0;  // n_ctx / n_parallel: output cells reserved per sequence
+};
+
+// Only through std::atomic_load / std::atomic_store.
+static std::shared_ptr<Engine> g_engine;
+static std::atomic<bool>       g_inited{false};
+static std::atomic<bool>       g_grammar{true};   // setConstrainedDecoding; applied to engines as they load
+static Options                 g_opt;             // from init; swapModel builds with the same settings
+static std::mutex              g_swap_mu;         // one swap at a time; shutdown waits for it
+
+static std::shared_ptr<Engine> engine() { return std::atomic_load(&g_engine); }
+
+// Finished plans; each engine's key_suffix is folded into every key.
+static std::unique_ptr<plancache::PlanCache> g_cache;
+
+// Prefix KV snapshot: <path> is the llama seq state, <path>.meta pins it to the
+// model file and prompt text it was made from.
+static std::string g_session_path;
+static bool        g_session_save = false;   // write on shutdown
+
+static std::string sessionMeta(const Engine& e) {
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%016llx %016llx", (unsigned long long)e.model_fp,
+                  (unsigned long long)plancache::fnv1a(e.tmpl.head));
+    return buf;
 }
-namespace prompt {
-    std::string buildPrompt(const std::string& profile_json);
+
+static bool sessionMatches(const Engine& e, const std::string& path) {
+    std::ifstream f(path + ".meta");
+    std::string line;
+    return f && std::getline(f, line) && line == sessionMeta(e);
 }
-namespace jsonutil {
-    std::string extractFirstJson(const std::string& text);
-    bool        looksLikeJson(const std::string& s);
+
+static bool saveSession(const Engine& e, const std::string& path) {
+    if (path.empty() || !e.pool->savePrefixState(path)) return false;
+    std::ofstream meta(path + ".meta", std::ios::trunc);
+    meta << sessionMeta(e) << "\n";
+    return (bool)meta;
 }
-namespace domain {
-    std::string checkAndFixPlan(const std::string& json);
+
+// Engine deleter. Freeing contexts and unmapping weights runs on a thread of
+// its own, so the last request off a swapped-out model doesn't wait for it.
+static std::mutex              g_retire_mu;
+static std::condition_variable g_retire_cv;
+static int                     g_retiring = 0;
+
+static void retireEngine(Engine* e) {
+    {
+        std::lock_guard<std::mutex> lk(g_retire_mu);
+        ++g_retiring;
+    }
+    std::thread([e] {
+        const std::string path = e->path;
+        delete e;
+        if (!path.empty()) std::cerr << "[swap] released " << path << "\n";
+        {
+            std::lock_guard<std::mutex> lk(g_retire_mu);
+            --g_retiring;
+        }
+        g_retire_cv.notify_all();
+    }).detach();
 }
 
-// ---- Public facade API (C++ namespace) ----
-namespace core {
+static void waitRetired() {
+    std::unique_lock<std::mutex> lk(g_retire_mu);
+    g_retire_cv.wait(lk, [] { return g_retiring == 0; });
+}
 
-static bool g_inited = false;
+// "" when the request can't be cached: sampled output without a fixed seed,
+// or a profile that isn't JSON.
+static std::string cacheKey(const Engine& e, const std::string& profile, const lw::GenParams& gp) {
+    if (!g_cache) return {};
+    const sampling::Params& sp = gp.sampling;
+    if (sp.temperature > 0.0f && sp.seed == 0) return {};
+    std::string key;
+    if (!jsonutil::canonicalize(profile, key)) return {};
+    char buf[160];
+    std::snprintf(buf, sizeof(buf), "\x1f%d|%d|%g|%d|%g|%g|%d|%u|%d", gp.max_tokens, (int)gp.stop_at_json_close,
+                  sp.temperature, sp.top_k, sp.top_p, sp.repeat_penalty, sp.repeat_last_n, sp.seed,
+                  (int)e.constrained.load());
+    key += buf;
+    for (const std::string& st : gp.stop) { key += '|'; key += std::to_string(plancache::fnv1a(st)); }
+    if (!gp.forced_output.empty()) { key += "|f"; key += std::to_string(plancache::fnv1a(gp.forced_output)); }
+    key += e.key_suffix;
+    return key;
+}
+
+static void cachePut(const std::string& key, const std::string& plan) {
+    if (key.empty() || plan.compare(0, 9, "{\"error\":") == 0) return;
+    g_cache->put(key, plan);
+}
 
-bool init(const std::string& model_path, int n_ctx = 2048, int n_gpu_layers = 0) {
-    g_inited = lw::init(model_path, n_ctx, n_gpu_layers);
-    return g_inited;
+static std::string finishPlan(const Engine& e, const std::string& raw, const std::string& profile,
+                              size_t keep_weeks = 0) {
+    if (metrics::debugLevel() >= 2)
+        std::cerr << "[diag] raw.size=" << raw.size() << " head=" << raw.substr(0, 2000) << "\n";
+    // Grammar output that parses cleanly goes straight through; the repair pass
+    // is only needed for free text or a max_tokens cut.
+    std::string cand;
+    {
+        metrics::ScopedTimer t(metrics::Stage::Extract);
+        if (!(e.constrained && jsonutil::looksLikeJson(raw))) {
+            cand = jsonutil::extractFirstJson(raw);
+            if (!jsonutil::looksLikeJson(cand)) cand = "{}";
+        }
+    }
+    metrics::ScopedTimer t(metrics::Stage::DomainFix);
+    std::string plan = domain::checkAndFixPlan(cand.empty() ? raw : cand, profile, keep_weeks);
+    if (metrics::debugLevel() >= 1)
+        std::cerr << "[diag] raw=" << raw.size() << "B repaired=" << (cand.empty() ? "no" : "yes")
+                  << " plan=" << plan.size() << "B\n";
+    return plan;
 }
 
-std::string generatePlan(const std::string& user_profile_json, int max_tokens = 10240) {
-    if (!g_inited) return "{}";
-    const std::string promptStr = prompt::buildPrompt(user_profile_json);
-    const std::string raw       = lw::generate(promptStr, max_tokens);
-    std::cerr << "[diag] raw.size=" << raw.size()
-          << " head=" << raw.substr(0, 2000) << "\n";
-    std::string cand            = jsonutil::extractFirstJson(raw);
-    if (!jsonutil::looksLikeJson(cand)) cand = "{}";
-    return domain::checkAndFixPlan(cand);
+static std::string timedPrompt(const Engine& e, const std::string& profile) {
+    metrics::ScopedTimer t(metrics::Stage::PromptBuild);
+    return prompt::buildPrompt(e.tmpl, profile);
 }
 
-void shutdown() { lw::shutdown(); g_inited = false; }
+// ---- Async scheduler ----
+
+struct PendingPlan : lw::Job {
+    std::shared_ptr<Engine>  engine;   // runs on the model it was submitted to; dropped once done
+    Priority                 priority = Priority::Interactive;
+    std::string              profile;
+    std::string              key;
+    std::atomic<bool>        cancelled{false};
+    std::promise<std::string> promise;
+
+    void fail(const std::string& why) { promise.set_exception(std::make_exception_ptr(std::runtime_error(why))); }
+};
+
+// One worker per pooled context. A worker holds its context only while the
+// decode loop has work, so the blocking generate* calls keep sharing the pool.
+// After a swap, plans queued for the old engine still run there, in order.
+class Scheduler final {
+public:
+    explicit Scheduler(int n_workers) {
+        for (int i = 0; i < n_workers; ++i) workers_.emplace_back([this] { work(); });
+    }
+
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+            for (auto& q : queue_) {
+                for (auto& p : q) { p->fail("shutting down"); p->engine.reset(); }
+                q.clear();
+            }
+            for (auto& kv : live_) kv.second->cancelled = true;
+        }
+        cv_.notify_all();
+        for (std::thread& t : workers_) t.join();
+    }
+
+    void submit(std::shared_ptr<PendingPlan> p) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (stop_) { p->fail("shutting down"); p->engine.reset(); return; }
+            queue_[(int)p->priority].push_back(std::move(p));
+        }
+        cv_.notify_one();
+    }
+
+    // Live requests see the flag at the next decode step; queued ones fail now.
+    void cancel(const std::shared_ptr<PendingPlan>& p) {
+        p->cancelled = true;
+        std::lock_guard<std::mutex> lk(mu_);
+        auto& q = queue_[(int)p->priority];
+        auto it = std::find(q.begin(), q.end(), p);
+        if (it == q.end()) return;
+        q.erase(it);
+        p->fail("cancelled");
+        p->engine.reset();
+    }
+
+private:
+    // The queues as one engine's decode loop sees them: only the front job,
+    // and only if it is for that engine.
+    struct Lane final : lw::JobSource {
+        Lane(Scheduler& s, const Engine* e) : s(s), e(e) {}
+        lw::Job* next(int kv_free, int free_slots, bool idle) override { return s.next(e, kv_free, free_slots, idle); }
+        void     finished(lw::Job* job, std::string text, std::string error) override {
+            s.finished(job, std::move(text), std::move(error));
+        }
+        Scheduler&    s;
+        const Engine* e;
+    };
+
+    lw::Job* next(const Engine* e, int kv_free, int free_slots, bool idle) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (stop_) return nullptr;
+        auto& inter = queue_[(int)Priority::Interactive];
+        auto& batch = queue_[(int)Priority::Batch];
+        std::deque<std::shared_ptr<PendingPlan>>* q = nullptr;
+        if (!inter.empty()) {
+            if (inter.front()->engine.get() == e && (idle || inter.front()->kv_need <= kv_free)) q = &inter;
+        } else if (!batch.empty()) {
+            if (batch.front()->engine.get() == e && (idle || (free_slots > 1 && batch.front()->kv_need <= kv_free)))
+                q = &batch;
+        }
+        if (!q) return nullptr;
+        std::shared_ptr<PendingPlan> p = std::move(q->front());
+        q->pop_front();
+        lw::Job* job = p.get();
+        live_.emplace(job, std::move(p));
+        return job;
+    }
+
+    void finished(lw::Job* job, std::string text, std::string error) {
+        std::shared_ptr<PendingPlan> p;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            auto it = live_.find(job);
+            if (it == live_.end()) return;
+            p = std::move(it->second);
+            live_.erase(it);
+        }
+        const std::shared_ptr<Engine> e = std::move(p->engine);
+        if (!error.empty()) { p->fail(error); return; }
+        try {
+            std::string plan = finishPlan(*e, text, p->profile);
+            cachePut(p->key, plan);
+            p->promise.set_value(std::move(plan));
+        } catch (const std::exception& ex) {
+            p->fail(ex.what());
+        }
+    }
+
+    void work() {
+        for (;;) {
+            std::shared_ptr<Engine> e;   // outlives the lease on its pool
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                cv_.wait(lk, [this] { return stop_ || !queue_[0].empty() || !queue_[1].empty(); });
+                if (stop_) return;
+                e = (queue_[0].empty() ? queue_[1] : queue_[0]).front()->engine;
+            }
+            try {
+                lw::ContextPool::Lease ctx = e->pool->acquire();
+                Lane lane(*this, e.get());
+                ctx->serve(lane);
+            } catch (const std::exception& ex) {
+                std::cerr << "[sched] " << ex.what() << "\n";
+            }
+        }
+    }
+
+    std::mutex                                                      mu_;
+    std::condition_variable                                         cv_;
+    std::deque<std::shared_ptr<PendingPlan>>                        queue_[2];   // by Priority
+    std::unordered_map<lw::Job*, std::shared_ptr<PendingPlan>>      live_;
+    bool                                                            stop_ = false;
+    std::vector<std::thread>                                        workers_;
+};
+
+static std::unique_ptr<Scheduler> g_sched;
+
+void Ticket::cancel() {
+    if (p_ && g_sched) g_sched->cancel(p_);
+}
+
+static bool applyGrammar(Engine& e, bool on) {
+    e.constrained = e.pool->setGrammar(on ? prompt::planGrammar() : std::string()) && on;
+    return e.constrained == on;
+}
+
+bool setConstrainedDecoding(bool on) {
+    g_grammar = on;
+    const std::shared_ptr<Engine> e = engine();
+    return e && applyGrammar(*e, on);
+}
+
+static const char* kvTypeName(lw::KvType t) {
+    switch (t) {
+        case lw::KvType::Q8_0: return "q8_0";
+        case lw::KvType::Q4_0: return "q4_0";
+        default:               return "f16";
+    }
+}
+
+// Prompt head/tail from the GGUF's chat template, so the model sees its own
+// turn markers; the built-in <|system|> format when it has none we can render.
+static prompt::Template selectTemplate(const lw::Model& m, bool use_model_template) {
+    std::string      rendered;
+    prompt::Template t;
+    if (use_model_template && m.renderChat(prompt::systemText(), prompt::userMessage(), rendered) &&
+        prompt::fromRendered(rendered, t)) {
+        std::cerr << "[init] prompt template: gguf (head " << t.head.size() << " B, tail " << t.tail.size()
+                  << " B)\n";
+        return t;
+    }
+    std::cerr << "[init] prompt template: built-in" << (use_model_template ? " (no usable gguf template)" : "")
+              << "\n";
+    return prompt::builtinTemplate();
+}
+
+// Automatic n_ctx: the unified KV cache holds the system prefix once plus, per
+// slot, a profile and ctx_gen_tokens of output; rounded up to 256 and capped
+// so it stays within kv_mem_mb at the chosen KV type.
+static int autoContextSize(const lw::Model& m, const prompt::Template& t, const Options& opt) {
+    constexpr int kProfileTokens = 256;   // buildPrompt's per-request part, with room to spare
+    const int    prefix  = m.countTokens(t.head, /*add_special*/ true);
+    const int    per_seq = kProfileTokens + std::max(1, opt.ctx_gen_tokens);
+    const long   need    = ((long)prefix + (long)std::max(1, opt.n_parallel) * per_seq + 255) / 256 * 256;
+    const size_t per_tok = m.kvBytesPerToken(opt.kv_type, opt.flash_attn);
+    long cap = need;
+    if (opt.kv_mem_mb > 0 && per_tok > 0)
+        cap = std::max(256L, (long)(opt.kv_mem_mb * 1024 * 1024 / per_tok) / 256 * 256);
+    const int n_ctx = (int)std::min(need, cap);
+    std::cerr << "[init] n_ctx auto=" << n_ctx << " (prefix " << prefix << " + " << std::max(1, opt.n_parallel)
+              << " x " << per_seq << ", kv " << (double)per_tok * n_ctx / (1024.0 * 1024.0) << " MiB)\n";
+    if (need > cap)
+        std::cerr << "[warn] kv_mem_mb=" << opt.kv_mem_mb << " fits " << cap << " of " << need
+                  << " tokens; long plans may be truncated (quantize the KV cache or lower --parallel)\n";
+    if (m.nCtxTrain() > 0 && prefix + per_seq > m.nCtxTrain())
+        std::cerr << "[warn] a sequence may reach " << prefix + per_seq << " positions; model trained on "
+                  << m.nCtxTrain() << "\n";
+    return n_ctx;
+}
+
+// Automatic offload: the weights are taken as the GGUF's size, in n_layer + 1
+// equal slices (the last one is the output head). Each offloaded layer also
+// brings its share of the KV cache (an automatic n_ctx counts kv_mem_mb per
+// context); 512 MiB per GPU is left for compute buffers. The hyperparameters
+// come from a vocab-only load.
+static int autoGpuLayers(const std::string& path, const lw::ModelParams& mp, const Options& opt,
+                         const std::vector<lw::GpuDevice>& gpus) {
+    if (gpus.empty()) return 0;
+    lw::ModelParams pp = mp;
+    pp.n_gpu_layers = 0;
+    pp.vocab_only   = true;
+    const std::shared_ptr<lw::Model> probe = lw::Model::load(path, pp);
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!probe || !f || probe->nLayer() <= 0) return 0;
+
+    const int    n_layer  = probe->nLayer();
+    const double weights  = (double)f.tellg();
+    const double kv_total = (opt.n_ctx > 0 ? (double)probe->kvBytesPerToken(opt.kv_type, opt.flash_attn) * opt.n_ctx
+                                           : (double)opt.kv_mem_mb * 1024 * 1024) *
+                            std::max(1, opt.n_contexts);
+    double free = 0;
+    for (const lw::GpuDevice& g : gpus) free += (double)g.free_bytes;
+    free -= (double)gpus.size() * 512 * 1024 * 1024;
+
+    const double per_layer = weights / (n_layer + 1) + kv_total / n_layer;
+    const int    fit       = free > 0 ? (int)std::min<double>(n_layer + 1, free / per_layer) : 0;
+    std::cerr << "[init] gpu layers auto=" << fit << "/" << n_layer + 1 << " (~"
+              << per_layer / (1024.0 * 1024.0) << " MiB per layer, " << free / (1024.0 * 1024.0 * 1024.0)
+              << " GiB usable)\n";
+    return fit > n_layer ? lw::kGpuLayersAll : fit;
+}
+
+static const char* splitName(lw::SplitMode m) {
+    switch (m) {
+        case lw::SplitMode::None: return "none";
+        case lw::SplitMode::Row:  return "row";
+        default:                  return "layer";
+    }
+}
+
+static const char* numaName(lw::Numa n) {
+    switch (n) {
+        case lw::Numa::Distribute: return "distribute";
+        case lw::Numa::Isolate:    return "isolate";
+        case lw::Numa::Numactl:    return "numactl";
+        case lw::Numa::Mirror:     return "mirror";
+        default:                   return "off";
+    }
+}
+
+// Loads a model, its contexts and prefix KV. prev = the engine being replaced:
+// its draft model is reused, the file is prefetched, and the session snapshot
+// is left to the engine init made.
+static std::shared_ptr<Engine> buildEngine(const std::string& model_path, const Options& opt, const Engine* prev) {
+    lw::ModelParams mp;
+    mp.n_gpu_layers = opt.n_gpu_layers;
+    mp.split_mode   = opt.split_mode;
+    mp.main_gpu     = opt.main_gpu;
+    mp.use_mlock    = opt.use_mlock;
+    mp.numa         = opt.numa;
+    mp.prefetch     = prev != nullptr;
+    if (!opt.tensor_split.empty()) {
+        mp.tensor_split = lw::parseTensorSplit(opt.tensor_split);
+        if (mp.tensor_split.empty())
+            std::cerr << "[warn] bad tensor split '" << opt.tensor_split << "'; splitting by free memory\n";
+    }
+
+    const std::vector<lw::GpuDevice> gpus = lw::detectGpus();
+    for (size_t i = 0; i < gpus.size(); ++i)
+        std::cerr << "[init] gpu" << i << " " << gpus[i].name << " (" << gpus[i].description << ") "
+                  << gpus[i].free_bytes / (1024.0 * 1024.0 * 1024.0) << "/"
+                  << gpus[i].total_bytes / (1024.0 * 1024.0 * 1024.0) << " GiB free\n";
+    if (mp.n_gpu_layers == lw::kGpuLayersAuto) mp.n_gpu_layers = autoGpuLayers(model_path, mp, opt, gpus);
+
+    lw::ContextParams cp;
+    cp.n_ctx           = opt.n_ctx;
+    cp.n_parallel      = opt.n_parallel;
+    cp.n_batch         = opt.n_batch;
+    cp.n_threads       = opt.n_threads;
+    cp.n_threads_batch = opt.n_threads_batch;
+    cp.n_lookup        = opt.n_lookup;
+    cp.kv_type         = opt.kv_type;
+    cp.flash_attn      = opt.flash_attn;
+    if (!opt.cpus.empty()) {
+        cp.cpus = lw::parseCpuList(opt.cpus);
+        if (cp.cpus.empty()) std::cerr << "[warn] bad cpu list '" << opt.cpus << "'; not pinning\n";
+    }
+
+    std::shared_ptr<Engine> e(new Engine(), retireEngine);
+    e->model = lw::Model::load(model_path, mp);
+    if (!e->model) return nullptr;
+    {
+        const int n_layer = e->model->nLayer();
+        const int on_gpu  = gpus.empty() ? 0
+                          : mp.n_gpu_layers == lw::kGpuLayersAll ? n_layer + 1
+                          : std::min(mp.n_gpu_layers, n_layer + 1);
+        std::cerr << "[init] placement: " << on_gpu << "/" << n_layer + 1 << " layers on " << gpus.size()
+                  << " gpu(s)";
+        if (on_gpu > 0 && gpus.size() > 1) {
+            std::cerr << " split=" << splitName(mp.split_mode) << " main_gpu=" << mp.main_gpu << " shares=";
+            if (mp.tensor_split.empty()) std::cerr << "by free memory";
+            for (size_t i = 0; i < mp.tensor_split.size(); ++i) std::cerr << (i ? "," : "") << mp.tensor_split[i];
+        }
+        std::cerr << "\n";
+        metrics::placement(on_gpu, n_layer, (int)gpus.size());
+    }
+    e->tmpl = selectTemplate(*e->model, opt.chat_template);
+    if (cp.n_ctx <= 0) cp.n_ctx = autoContextSize(*e->model, e->tmpl, opt);
+
+    if (prev && prev->draft) {
+        e->draft = prev->draft;
+    } else if (!opt.draft_model_path.empty()) {
+        lw::ModelParams dp = mp;
+        if (opt.draft_gpu_layers >= 0) dp.n_gpu_layers = opt.draft_gpu_layers;
+        e->draft = lw::Model::load(opt.draft_model_path, dp);
+        if (!e->draft) std::cerr << "[warn] draft model not loaded; decoding without speculation\n";
+        std::cerr << "[init] draft=" << opt.draft_model_path << " n_draft=" << opt.n_draft << "\n";
+    }
+    cp.draft   = e->draft;
+    cp.n_draft = opt.n_draft;
+
+    e->pool = lw::ContextPool::create(e->model, cp, std::max(1, opt.n_contexts));
+    if (!e->pool) return nullptr;
+    e->path     = model_path;
+    e->kv_share = std::max(1, cp.n_ctx / std::max(1, cp.n_parallel));
+
+    e->model_fp = plancache::fingerprintFile(model_path);
+    // KV precision and context size change greedy output and where a plan gets cut off
+    char buf[160];
+    std::snprintf(buf, sizeof(buf), "\x1f%016llx|%016llx|%016llx|%016llx|kv=%s|fa=%d|ctx=%d|par=%d",
+                  (unsigned long long)e->model_fp,
+                  (unsigned long long)plancache::fnv1a(e->tmpl.head),
+                  (unsigned long long)plancache::fnv1a(e->tmpl.tail),
+                  (unsigned long long)plancache::fnv1a(prompt::planGrammar()),
+                  kvTypeName(opt.kv_type), (int)opt.flash_attn, cp.n_ctx, std::max(1, cp.n_parallel));
+    e->key_suffix = buf;
+
+    // Decode the static coach rules + schema once; requests then only pay for the profile.
+    // A matching session file restores that KV without a prefill.
+    const auto t0 = std::chrono::steady_clock::now();
+    const bool use_session = !prev && !g_session_path.empty();
+    bool warm = use_session && sessionMatches(*e, g_session_path) &&
+                e->pool->loadPrefixState(g_session_path, e->tmpl.head);
+    if (!warm && !e->pool->setPrefix(e->tmpl.head))
+        std::cerr << "[warn] system prefix not cached; decoding full prompt per request\n";
+    e->pool->setSuffix(e->tmpl.tail);
+    // Written straight away after a cold prefill too, so a container that gets
+    // killed instead of shut down still leaves one behind.
+    if (use_session)
+        g_session_save = !warm && !saveSession(*e, g_session_path) && opt.session_save_on_exit;
+    const double prefix_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "[init] prefix " << (warm ? "restored from " + g_session_path : std::string("decoded")) << " in "
+              << prefix_ms << " ms";
+    if (!warm && prefix_ms > 0)   // first prefill figure for this placement
+        std::cerr << " (" << e->model->countTokens(e->tmpl.head, /*add_special*/ true) * 1000.0 / prefix_ms
+                  << " tok/s)";
+    std::cerr << "\n";
+    if (!applyGrammar(*e, g_grammar))
+        std::cerr << "[warn] plan grammar rejected; falling back to free-text decoding\n";
+    return e;
+}
+
+bool init(const std::string& model_path, const Options& opt) {
+    if (g_inited) return true;
+    if (opt.debug_level >= 0) metrics::setDebugLevel(opt.debug_level);
+
+    const lw::CpuTopology topo = lw::detectTopology();
+    const int n_ctxs = std::max(1, opt.n_contexts);
+    std::cerr << "[init] cpu logical=" << topo.logical << " physical=" << topo.physical
+              << " numa_nodes=" << topo.numa_nodes
+              << " | contexts=" << n_ctxs
+              << " threads=" << (opt.n_threads > 0 ? opt.n_threads : std::max(1, topo.physical / n_ctxs))
+              << " threads_batch=" << (opt.n_threads_batch > 0 ? opt.n_threads_batch
+                                                               : std::max(1, topo.logical / n_ctxs))
+              << " numa=" << numaName(opt.numa)
+              << " pin=" << (opt.cpus.empty() ? "off" : opt.cpus)
+              << " mlock=" << (opt.use_mlock ? "on" : "off")
+              << " lookup=" << opt.n_lookup
+              << " kv=" << kvTypeName(opt.kv_type) << (opt.flash_attn ? " flash_attn=on" : "") << "\n";
+    if (opt.kv_type != lw::KvType::F16 && !opt.flash_attn)
+        std::cerr << "[init] note: V cache stays f16 without flash attention\n";
+    if (opt.numa == lw::Numa::Disabled && topo.numa_nodes > 1)
+        std::cerr << "[init] note: " << topo.numa_nodes << " NUMA nodes and numa=off\n";
+
+    g_session_path = opt.session_path;
+    g_grammar      = true;
+    std::shared_ptr<Engine> e = buildEngine(model_path, opt, nullptr);
+    if (!e) {
+        g_session_path.clear();
+        waitRetired();
+        return false;
+    }
+    if (opt.cache_entries > 0 || !opt.cache_dir.empty())
+        g_cache.reset(new plancache::PlanCache(opt.cache_entries, opt.cache_dir));
+    g_opt = opt;
+    g_sched.reset(new Scheduler(n_ctxs));
+    std::atomic_store(&g_engine, std::move(e));
+    g_inited = true;
+    return true;
+}
+
+std::future<bool> swapModel(const std::string& model_path) {
+    auto done = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = done->get_future();
+    std::thread([model_path, done] {
+        bool ok = false;
+        try {
+            std::lock_guard<std::mutex> lk(g_swap_mu);
+            const std::shared_ptr<Engine> cur = engine();
+            if (!g_inited || !cur) {
+                std::cerr << "[swap] core not initialised\n";
+            } else {
+                const auto t0 = std::chrono::steady_clock::now();
+                std::shared_ptr<Engine> next = buildEngine(model_path, g_opt, cur.get());
+                const double ms =
+                    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+                if (!next) {
+                    std::cerr << "[swap] loading " << model_path << " failed; still serving " << cur->path << "\n";
+                } else {
+                    std::atomic_store(&g_engine, std::move(next));
+                    std::cerr << "[swap] serving " << model_path << " (ready in " << ms << " ms); " << cur->path
+                              << " drains\n";
+                    ok = true;
+                }
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "[swap] " << ex.what() << "\n";
+        }
+        done->set_value(ok);
+    }).detach();
+    return result;
+}
+
+std::string currentModel() {
+    const std::shared_ptr<Engine> e = engine();
+    return e ? e->path : std::string();
+}
+
+bool init(const std::string& model_path, int n_ctx, int n_gpu_layers, int n_parallel, int n_batch,
+          int n_contexts) {
+    Options opt;
+    opt.n_ctx        = n_ctx;
+    opt.n_gpu_layers = n_gpu_layers;
+    opt.n_parallel   = n_parallel;
+    opt.n_batch      = n_batch;
+    opt.n_contexts   = n_contexts;
+    return init(model_path, opt);
+}
+
+std::string generatePlan(const std::string& user_profile_json, const lw::GenParams& gp) {
+    const std::shared_ptr<Engine> e = engine();
+    if (!e) return "{}";
+    const std::string key = cacheKey(*e, user_profile_json, gp);
+    std::string plan;
+    metrics::add(metrics::Counter::Requests);
+    if (!key.empty() && g_cache->get(key, plan)) { metrics::add(metrics::Counter::CacheHits); return plan; }
+    const std::string promptStr = timedPrompt(*e, user_profile_json);
+    const std::string raw       = e->pool->generate(promptStr, gp);
+    plan = finishPlan(*e, raw, user_profile_json);
+    cachePut(key, plan);
+    return plan;
+}
+
+std::string updatePlan(const std::string& previous_plan, const std::string& profile_json,
+                       const std::string& profile_delta, int from_week, const lw::GenParams& gp) {
+    const std::shared_ptr<Engine> e = engine();
+    if (!e) return "{}";
+    std::string profile = profile_json;
+    if (!profile_delta.empty() && !jsonutil::mergePatch(profile_json, profile_delta, profile)) {
+        std::cerr << "[warn] updatePlan: profile or delta is not a JSON object; delta ignored\n";
+        profile = profile_json;
+    }
+    domain::Plan prev;
+    if (from_week <= 1 || !domain::parsePlan(previous_plan, prev)) return generatePlan(profile, gp);
+
+    const size_t keep = std::min((size_t)(from_week - 1), prev.weeks.size());
+    lw::GenParams forced = gp;
+    forced.forced_output = domain::serializeHead(prev, keep);
+
+    const std::string key = cacheKey(*e, profile, forced);
+    std::string plan;
+    metrics::add(metrics::Counter::Requests);
+    if (!key.empty() && g_cache->get(key, plan)) { metrics::add(metrics::Counter::CacheHits); return plan; }
+    const std::string promptStr = timedPrompt(*e, profile);
+    const std::string raw       = e->pool->generate(promptStr, forced);   // starts with forced_output
+    plan = finishPlan(*e, raw, profile, keep);
+    cachePut(key, plan);
+    return plan;
+}
+
+std::string generatePlanStream(const std::string& user_profile_json, const lw::GenParams& gp,
+                               const StreamHandlers& handlers) {
+    const std::shared_ptr<Engine> e = engine();
+    if (!e) return "{}";
+    const std::string key = cacheKey(*e, user_profile_json, gp);
+    std::string plan;
+    jsonutil::ArrayElementScanner weeks("weeks");
+    metrics::add(metrics::Counter::Requests);
+    if (!key.empty() && g_cache->get(key, plan)) {
+        metrics::add(metrics::Counter::CacheHits);
+        // replay the cached plan as one piece
+        if (handlers.on_week) weeks.feed(plan, handlers.on_week);
+        if (handlers.on_piece) handlers.on_piece(plan);
+        return plan;
+    }
+    const std::string promptStr = timedPrompt(*e, user_profile_json);
+    const lw::PieceFn sink = [&](const std::string& piece) {
+        // Only structurally valid weeks go out; free-text decoding can close brackets on junk.
+        if (handlers.on_week)
+            weeks.feed(piece, [&](int i, const std::string& w) { if (jsonutil::parseJson(w)) handlers.on_week(i, w); });
+        return handlers.on_piece ? handlers.on_piece(piece) : true;
+    };
+    const std::string raw       = e->pool->generate(promptStr, gp, sink);
+    plan = finishPlan(*e, raw, user_profile_json);
+    cachePut(key, plan);
+    return plan;
+}
+
+std::string generatePlan(const std::string& user_profile_json, int max_tokens) {
+    lw::GenParams gp;
+    gp.max_tokens = max_tokens;
+    return generatePlan(user_profile_json, gp);
+}
+
+std::vector<std::string> generatePlans(const std::vector<std::string>& user_profiles, const lw::GenParams& gp) {
+    std::vector<std::string> plans(user_profiles.size(), "{}");
+    const std::shared_ptr<Engine> e = engine();
+    if (!e) return plans;
+    // only cache misses go to the engine
+    std::vector<std::string> keys(user_profiles.size());
+    std::vector<std::string> prompts;
+    std::vector<size_t>      todo;
+    metrics::add(metrics::Counter::Requests, user_profiles.size());
+    for (size_t i = 0; i < user_profiles.size(); ++i) {
+        keys[i] = cacheKey(*e, user_profiles[i], gp);
+        if (!keys[i].empty() && g_cache->get(keys[i], plans[i])) { metrics::add(metrics::Counter::CacheHits); continue; }
+        todo.push_back(i);
+        prompts.push_back(timedPrompt(*e, user_profiles[i]));
+    }
+    if (prompts.empty()) return plans;
+    const std::vector<std::string> raws = e->pool->generateBatch(prompts, gp);
+    for (size_t j = 0; j < raws.size(); ++j) {
+        const size_t i = todo[j];
+        plans[i] = finishPlan(*e, raws[j], user_profiles[i]);
+        cachePut(keys[i], plans[i]);
+    }
+    return plans;
+}
+
+Ticket submitPlan(const std::string& user_profile_json, const lw::GenParams& gp, const SubmitOptions& opts) {
+    Ticket t;
+    t.p_   = std::make_shared<PendingPlan>();
+    t.plan = t.p_->promise.get_future();
+    PendingPlan& p = *t.p_;
+    const std::shared_ptr<Engine> e = engine();
+    if (!e || !g_sched) { p.fail("core not initialised"); return t; }
+
+    p.priority = opts.priority;
+    p.profile  = user_profile_json;
+    p.on_piece = opts.on_piece;
+    p.gp       = gp;
+    if (opts.max_tokens > 0) p.gp.max_tokens = opts.max_tokens;
+    p.gp.cancel = &p.cancelled;
+    if (opts.timeout_ms > 0)
+        p.gp.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(opts.timeout_ms);
+
+    metrics::add(metrics::Counter::Requests);
+    p.key = cacheKey(*e, user_profile_json, p.gp);
+    std::string plan;
+    if (!p.key.empty() && g_cache->get(p.key, plan)) {
+        metrics::add(metrics::Counter::CacheHits);
+        p.promise.set_value(std::move(plan));
+        return t;
+    }
+    p.prompt = timedPrompt(*e, user_profile_json);
+    // ~3 bytes per token past the shared prefix, plus the output reservation
+    const size_t sys = e->tmpl.head.size();
+    p.kv_need = (int)((p.prompt.size() > sys ? p.prompt.size() - sys : p.prompt.size()) / 3) +
+                std::min(p.gp.max_tokens, e->kv_share);
+    p.engine  = e;
+    g_sched->submit(t.p_);
+    return t;
+}
+
+std::vector<std::string> generatePlans(const std::vector<std::string>& user_profiles, int max_tokens) {
+    lw::GenParams gp;
+    gp.max_tokens = max_tokens;
+    return generatePlans(user_profiles, gp);
+}
+
+plancache::Stats cacheStats() {
+    return g_cache ? g_cache->stats() : plancache::Stats();
+}
+
+bool saveSession(const std::string& path) {
+    const std::shared_ptr<Engine> e = engine();
+    return e && saveSession(*e, path.empty() ? g_session_path : path);
+}
+
+std::string metricsJson()       { return metrics::toJson(); }
+std::string metricsPrometheus() { return metrics::toPrometheus(); }
+
+lw::SpecStats speculationStats() {
+    const std::shared_ptr<Engine> e = engine();
+    return e ? e->pool->specStats() : lw::SpecStats();
+}
+
+void shutdown() {
+    std::lock_guard<std::mutex> lk(g_swap_mu);   // lets a swap in progress finish first
+    g_sched.reset();   // fails queued tickets, cancels live ones, joins the workers
+    if (g_session_save && saveSession())
+        std::cerr << "[shutdown] prefix state saved to " << g_session_path << "\n";
+    g_session_save = false;
+    g_session_path.clear();
+    g_inited = false;
+    g_cache.reset();
+    std::atomic_store(&g_engine, std::shared_ptr<Engine>());
+    waitRetired();   // models and contexts are freed once this returns
+}
 
 } // namespace core
@@ -0,0 +1,143 @@
+// CoreFacade.h
+// Public pipeline API: buildPrompt -> lw::generate -> extractFirstJson -> domain check.
+
+#pragma once
+
+#include "LlamaWrapper.h"
+#include "PlanCache.h"
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace core {
+
+struct Options {
+    int         n_ctx           = 2048;   // 0 = size it: prefix + n_parallel x (profile + ctx_gen_tokens)
+    int         ctx_gen_tokens  = 2048;   // output per sequence that an automatic n_ctx leaves room for
+    size_t      kv_mem_mb       = 2048;   // ceiling for an automatic n_ctx's KV cache, per context
+    lw::KvType  kv_type         = lw::KvType::F16;   // q8_0 / q4_0 fit ~2x / ~3.5x the tokens
+    bool        flash_attn      = false;  // also required for a quantized V cache
+    int         n_gpu_layers    = 0;      // 0 = CPU only; -1 = all; -2 = as many as fit free VRAM
+    lw::SplitMode split_mode    = lw::SplitMode::Layer;  // across several GPUs
+    int         main_gpu        = 0;
+    std::string tensor_split;             // per-GPU shares, e.g. "3,1"; empty = by free memory
+    int         n_parallel      = 1;      // plans each context decodes concurrently (generatePlans)
+    int         n_batch         = 0;      // max tokens per decode call; 0 picks min(n_ctx, 512)
+    int         n_contexts      = 1;      // pooled contexts; that many threads can run generatePlan* at once
+    int         n_threads       = 0;      // generation threads per context; 0 = physical cores / n_contexts
+    int         n_threads_batch = 0;      // prefill threads per context; 0 = logical cores / n_contexts
+    lw::Numa    numa            = lw::Numa::Disabled;
+    std::string cpus;                     // pin to a CPU list, e.g. "0-15,32-47"; split across contexts
+    bool        use_mlock       = false;
+    std::string draft_model_path;         // small same-vocab GGUF for speculative decoding; empty = off
+    int         n_draft         = 8;      // tokens the draft proposes per step
+    int         draft_gpu_layers = -1;    // -1 = same as n_gpu_layers
+    int         n_lookup        = 0;      // without a draft model: n-gram lookup drafts per step; 0 = off
+    size_t      cache_entries   = 256;    // in-memory plan LRU; 0 (and no cache_dir) = no caching
+    std::string cache_dir;                // also persist plans here (one file per key)
+    std::string session_path;             // prefix KV snapshot: restored at init when it matches,
+                                          // written after a cold prefill otherwise
+    bool        session_save_on_exit = true;   // retry that write at shutdown if it failed
+    bool        chat_template   = true;   // wrap the prompt in the GGUF's chat template; false = built-in
+    int         debug_level     = -1;     // -1 = $WORKOUT_DEBUG; 1 = per-plan summary, 2 = dump raw output
+};
+
+// Loads the model and the context pool and logs the CPU topology + chosen
+// settings. init/shutdown are not thread-safe and must not race with generation.
+bool init(const std::string& model_path, const Options& opt);
+bool init(const std::string& model_path, int n_ctx = 2048, int n_gpu_layers = 0, int n_parallel = 1,
+          int n_batch = 0, int n_contexts = 1);
+
+// Load another GGUF beside the live one with init's Options and switch to it
+// once it is warm: file prefetched into the page cache, contexts created,
+// prefix decoded. Requests from then on run on the new model; those already
+// running or queued finish on the old one, which is freed (and unmapped)
+// after the last of them. Both models are resident until then. Runs on a
+// thread of its own; false if the new model failed to load, in which case the
+// old one keeps serving. One swap at a time; shutdown waits for it.
+std::future<bool> swapModel(const std::string& model_path);
+std::string       currentModel();   // path of the model new requests go to
+
+// Grammar-constrained plan decoding (on by default after init).
+bool setConstrainedDecoding(bool on);
+
+std::string generatePlan(const std::string& user_profile_json, int max_tokens = 10240);
+std::string generatePlan(const std::string& user_profile_json, const lw::GenParams& gp);
+
+// Regenerate a plan from week from_week (1-based) on. The earlier weeks of
+// previous_plan are fed to the model as forced output (prefilled, not sampled),
+// so decoding covers only the weeks that change; the domain rules re-check
+// just those, with the kept weeks as progression baseline. profile_delta (may
+// be empty) is merged over profile_json as a top-level JSON merge patch.
+std::string updatePlan(const std::string& previous_plan, const std::string& profile_json,
+                       const std::string& profile_delta, int from_week, const lw::GenParams& gp);
+
+// Streaming variant. on_piece gets raw model text as it is decoded (UTF-8 safe;
+// return false to cancel); on_week fires as each weeks[] element closes, before
+// the domain pass. The return value is the final, checked plan.
+struct StreamHandlers {
+    lw::PieceFn                                                   on_piece;
+    std::function<void(int week_index, const std::string& week)> on_week;
+};
+std::string generatePlanStream(const std::string& user_profile_json, const lw::GenParams& gp,
+                               const StreamHandlers& handlers);
+
+// Many profiles in one go; sequences are interleaved in shared llama_batch steps.
+std::vector<std::string> generatePlans(const std::vector<std::string>& user_profiles, int max_tokens = 10240);
+std::vector<std::string> generatePlans(const std::vector<std::string>& user_profiles, const lw::GenParams& gp);
+
+// Async API. Submitted plans queue per priority class and join the pooled
+// contexts' decode loops between steps (continuous batching), so a long plan
+// never holds up the ones behind it. Interactive requests are always admitted
+// first; batch requests only take a slot when another one stays free (or the
+// context is otherwise idle), and only when the KV cache has room for their
+// prompt plus output budget.
+enum class Priority { Interactive, Batch };
+
+struct SubmitOptions {
+    Priority    priority   = Priority::Interactive;
+    int         timeout_ms = 0;   // deadline from submission, queueing included; 0 = none
+    int         max_tokens = 0;   // token budget; 0 = gp.max_tokens
+    lw::PieceFn on_piece;         // raw text as decoded, on a scheduler thread; false stops early
+};
+
+struct PendingPlan;
+
+class Ticket {
+public:
+    // The checked plan; throws std::runtime_error once cancelled, past the
+    // deadline, or on a decode failure.
+    std::future<std::string> plan;
+
+    // Stops the request, queued or mid-decode. Safe from any thread, any time.
+    void cancel();
+
+private:
+    friend Ticket submitPlan(const std::string&, const lw::GenParams&, const SubmitOptions&);
+    std::shared_ptr<PendingPlan> p_;
+};
+
+Ticket submitPlan(const std::string& user_profile_json, const lw::GenParams& gp, const SubmitOptions& opts = {});
+
+// Write the prefix KV snapshot (default path: Options::session_path).
+bool saveSession(const std::string& path = {});
+
+// Plan cache counters since init. Only greedy or fixed-seed requests with a JSON
+// profile are cached; the key also covers the model file, prompt/grammar text,
+// KV cache type, flash attention, n_ctx and n_parallel.
+plancache::Stats cacheStats();
+
+// Pipeline metrics (stage timers, token counts, tokens/s, KV usage) as one
+// JSON object or Prometheus text exposition. Raw-output dumps are gated by
+// metrics::debugLevel() ($WORKOUT_DEBUG, or Options::debug_level).
+std::string metricsJson();
+std::string metricsPrometheus();
+
+// Speculative decoding counters since init (all zero without a draft model).
+lw::SpecStats speculationStats();
+
+void shutdown();
+
+} // namespace core
@@ -1,25 +1,482 @@
 // Domain.cpp
-// Minimal domain validation/fix (demo). Extend with real JSON parsing later.
+// Plan parsing (SAX, no DOM), rule checks/repairs, and one-shot serialization.
 
-#include <string>
+#include "Domain.h"
+#include "JsonUtil.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
 
 namespace domain {
 
-// Very naive: if no "rest" mention, append an "adjustments" hint.
-static std::string ensureRestHint(const std::string& json) {
-    if (json.find("\"rest\"") != std::string::npos) return json;
-    if (!json.empty() && json.back() == '}') {
-        std::string s = json; s.pop_back();
-        s += R"(,"adjustments":["insert_rest_day_suggestion"]})";
+static constexpr float kMaxProgression = 1.10f;   // week over last non-deload week
+static constexpr float kDeloadMax      = 0.80f;   // deload week over the week before it
+static constexpr float kDeloadTarget   = 0.70f;
+static constexpr int   kDeloadEvery    = 4;
+static constexpr int   kMaxRestDays    = 2;
+
+// ---- text helpers (ASCII, case-insensitive) ----
+
+static inline char lower(char c) { return (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c; }
+static inline bool is_alpha(char c) { c = lower(c); return c >= 'a' && c <= 'z'; }
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static size_t find_ci(std::string_view hay, std::string_view needle, size_t from = 0) {
+    if (needle.size() > hay.size()) return std::string_view::npos;
+    for (size_t i = from; i + needle.size() <= hay.size(); ++i) {
+        size_t k = 0;
+        while (k < needle.size() && lower(hay[i + k]) == needle[k]) ++k;
+        if (k == needle.size()) return i;
+    }
+    return std::string_view::npos;
+}
+
+static bool has_word(std::string_view hay, std::string_view word) {
+    for (size_t p = find_ci(hay, word); p != std::string_view::npos; p = find_ci(hay, word, p + 1)) {
+        const bool l = p == 0 || !is_alpha(hay[p - 1]);
+        const bool r = p + word.size() == hay.size() || !is_alpha(hay[p + word.size()]);
+        if (l && r) return true;
+    }
+    return false;
+}
+
+// Matches at word starts only, so "run" hits "runs"/"running" but not "brunch".
+static bool has_any(std::string_view hay, const char* const* words) {
+    for (; *words; ++words) {
+        const std::string_view w = *words;
+        for (size_t p = find_ci(hay, w); p != std::string_view::npos; p = find_ci(hay, w, p + 1))
+            if (p == 0 || !is_alpha(hay[p - 1])) return true;
+    }
+    return false;
+}
+
+static const char* const kHighImpact[] = {
+    "run", "jog", "sprint", "interval", "hill", "tempo", "fartlek", "stride", "plyo", "jump", "race", nullptr
+};
+// Injuries that don't rule out impact work on the legs.
+static const char* const kUpperBody[] = { "shoulder", "elbow", "wrist", "hand", "neck", nullptr };
+
+static Unit unit_of(std::string_view w, float value) {
+    if (w == "km" || w == "k" || w == "kms")                         return Unit::Km;
+    if (w == "mi" || w == "mile" || w == "miles")                    return Unit::Mi;
+    if (w == "min" || w == "mins" || w == "minute" || w == "minutes") return Unit::Min;
+    if (w == "h" || w == "hr" || w == "hrs" || w == "hour" || w == "hours") return Unit::Hr;
+    if (w == "m")  return value >= 100.0f ? Unit::M : Unit::Min;      // "400m" vs "30m"
+    return Unit::None;
+}
+
+static inline float parse_num(std::string_view t, size_t& i) {
+    float v = 0.0f, scale = 0.0f;
+    for (; i < t.size() && (is_digit(t[i]) || (t[i] == '.' && scale == 0.0f)); ++i) {
+        if (t[i] == '.') { scale = 1.0f; continue; }
+        if (scale > 0.0f) { scale *= 0.1f; v += (t[i] - '0') * scale; }
+        else v = v * 10.0f + (t[i] - '0');
+    }
+    return v;
+}
+
+// First "<n> unit" or "<a>-<b> unit" figure, with an optional "<r>x" in front of it.
+static void find_quantity(Session& s, std::string_view t) {
+    float  reps  = 1.0f;
+    size_t after = std::string_view::npos;   // just past an "<r>x"
+    for (size_t i = 0; i < t.size();) {
+        if (!is_digit(t[i]) || (i > 0 && i != after && is_alpha(t[i - 1]))) { ++i; continue; }
+        const size_t start = i;
+        float        v     = parse_num(t, i);
+        float        lo    = 0.0f;
+        if (i < t.size() && (t[i] == 'x' || t[i] == 'X') && (i + 1 == t.size() || !is_alpha(t[i + 1]))) {
+            reps = v; after = ++i; continue;
+        }
+        if (i + 1 < t.size() && t[i] == '-' && is_digit(t[i + 1])) {   // range: scaled as one figure
+            ++i;
+            lo = v;
+            v  = parse_num(t, i);
+        }
+        const size_t len = i - start;
+        size_t w = i;
+        while (w < t.size() && t[w] == ' ') ++w;
+        size_t we = w;
+        char   word[8];
+        while (we < t.size() && is_alpha(t[we]) && we - w < sizeof(word)) { word[we - w] = lower(t[we]); ++we; }
+        const Unit u = unit_of(std::string_view(word, we - w), v);
+        if (u != Unit::None && (we == t.size() || !is_alpha(t[we]))) {
+            s.qty_off = (uint32_t)start; s.qty_len = (uint32_t)len;
+            s.qty = v; s.qty_lo = lo; s.reps = reps; s.unit = u;
+            return;
+        }
+        reps = 1.0f;
+    }
+}
+
+float Session::load() const {
+    if (dropped || qty_len == 0) return 0.0f;
+    float per = 0.0f;
+    switch (unit) {
+    case Unit::Km:  per = 6.0f;   break;   // ~6 min/km easy pace
+    case Unit::Mi:  per = 9.7f;   break;
+    case Unit::M:   per = 0.006f; break;
+    case Unit::Min: per = 1.0f;   break;
+    case Unit::Hr:  per = 60.0f;  break;
+    default: break;
+    }
+    const float q = qty_lo > 0.0f ? (qty_lo + qty) * 0.5f : qty;
+    return q * reps * per;
+}
+
+// ---- parsing ----
+
+namespace {
+
+struct PlanBuilder : jsonutil::JsonHandler {
+    enum Ctx : uint8_t { Root, Weeks, WeekObj, Sessions, RestDays, Skip };
+
+    Plan&            p;
+    std::vector<Ctx> stack;
+    std::string_view cur_key;
+    std::unordered_map<std::string_view, Str> interned;   // views into p.text (reserved, never moves)
+
+    explicit PlanBuilder(Plan& plan) : p(plan) {}
+
+    Str intern(std::string_view raw) {
+        auto it = interned.find(raw);
+        if (it != interned.end()) return it->second;
+        const Str s{ (uint32_t)p.text.size(), (uint32_t)raw.size() };
+        p.text.append(raw);
+        interned.emplace(p.str(s), s);
         return s;
     }
-    return json;
+
+    Ctx child(bool array) const {
+        if (stack.empty()) return array ? Skip : Root;
+        switch (stack.back()) {
+        case Root:
+            if (array && cur_key == "weeks")     return Weeks;
+            if (array && cur_key == "rest_days") return RestDays;
+            return Skip;
+        case Weeks:   return array ? Skip : WeekObj;
+        case WeekObj: return (array && cur_key == "sessions") ? Sessions : Skip;
+        default:      return Skip;
+        }
+    }
+
+    bool open(bool array) {
+        const Ctx c = child(array);
+        if (c == WeekObj) {
+            Week w;
+            w.number = (int)p.weeks.size() + 1;
+            w.first  = (uint32_t)p.sessions.size();
+            p.weeks.push_back(w);
+        }
+        stack.push_back(c);
+        return true;
+    }
+    bool close() {
+        if (stack.back() == WeekObj) p.weeks.back().count = (uint32_t)p.sessions.size() - p.weeks.back().first;
+        stack.pop_back();
+        return true;
+    }
+
+    bool startObject() override { return open(false); }
+    bool startArray()  override { return open(true); }
+    bool endObject()   override { return close(); }
+    bool endArray()    override { return close(); }
+    bool key(std::string_view k) override { cur_key = k; return true; }
+
+    bool string(std::string_view s) override {
+        if (stack.empty()) return true;
+        switch (stack.back()) {
+        case Root:     if (cur_key == "goal") p.goal = intern(s); break;
+        case RestDays: p.rest_days.push_back(intern(s)); break;
+        case Sessions: {
+            Session se;
+            se.text        = intern(s);
+            se.rest        = has_word(s, "rest") || has_word(s, "off");
+            se.high_impact = !se.rest && has_any(s, kHighImpact);
+            find_quantity(se, s);
+            p.sessions.push_back(se);
+            break;
+        }
+        default: break;
+        }
+        return true;
+    }
+    bool number(std::string_view n) override {
+        if (!stack.empty() && stack.back() == WeekObj && cur_key == "week") {
+            size_t i = 0;
+            const float v = parse_num(n, i);
+            if (v >= 1.0f) p.weeks.back().number = (int)v;
+        }
+        return true;
+    }
+};
+
+struct ProfileBuilder : jsonutil::JsonHandler {
+    Profile&         out;
+    int              depth = 0;
+    bool             in_injuries = false;
+    std::string_view cur_key;
+
+    explicit ProfileBuilder(Profile& p) : out(p) {}
+
+    bool startObject() override { ++depth; return true; }
+    bool endObject()   override { --depth; return true; }
+    bool startArray()  override { in_injuries = depth == 1 && cur_key == "injuries"; return true; }
+    bool endArray()    override { in_injuries = false; return true; }
+    bool key(std::string_view k) override { cur_key = k; return true; }
+    bool string(std::string_view s) override {
+        if (in_injuries || (depth == 1 && cur_key == "injuries" && !s.empty())) {
+            std::string v(s);
+            for (char& c : v) c = lower(c);
+            if (v != "none" && !v.empty()) out.injuries.push_back(std::move(v));
+        }
+        return true;
+    }
+};
+
+} // namespace
+
+bool parsePlan(std::string_view json, Plan& out) {
+    out = Plan();
+    out.text.reserve(json.size());
+    PlanBuilder b(out);
+    return jsonutil::parseJson(json, &b) && !out.weeks.empty();
+}
+
+Profile parseProfile(std::string_view json) {
+    Profile p;
+    ProfileBuilder b(p);
+    if (!json.empty()) jsonutil::parseJson(json, &b);
+    return p;
+}
+
+// ---- rules ----
+
+static std::string fmt_qty(float v, Unit u) {
+    char buf[32];
+    if (u == Unit::M)        std::snprintf(buf, sizeof(buf), "%d", (int)(std::round(v / 50.0f) * 50.0f));
+    else if (u == Unit::Min) std::snprintf(buf, sizeof(buf), "%d", (int)std::lround(v));
+    else {
+        std::snprintf(buf, sizeof(buf), "%.1f", v);
+        const size_t n = std::strlen(buf);
+        if (n > 2 && buf[n - 1] == '0' && buf[n - 2] == '.') buf[n - 2] = '\0';
+    }
+    return buf;
+}
+
+// Replace the session's figure in the arena with qty * f.
+static void scale_session(Plan& p, Session& s, float f) {
+    if (s.qty_len == 0 || s.dropped) return;
+    const std::string_view t = p.str(s.text);
+    const float q = s.qty * f;
+    std::string r;
+    r.reserve(t.size() + 8);
+    r.append(t.substr(0, s.qty_off));
+    if (s.qty_lo > 0.0f) { s.qty_lo *= f; r.append(fmt_qty(s.qty_lo, s.unit)).append("-"); }
+    r.append(fmt_qty(q, s.unit)).append(t.substr(s.qty_off + s.qty_len));
+    const uint32_t new_len = (uint32_t)(r.size() - (t.size() - s.qty_len));
+    s.text    = Str{ (uint32_t)p.text.size(), (uint32_t)r.size() };
+    s.qty_len = new_len;
+    s.qty     = q;
+    p.text   += r;
+}
+
+static void note(Plan& p, int week, const char* fmt, double a = 0, double b = 0) {
+    char buf[160];
+    const int n = std::snprintf(buf, sizeof(buf), "week %d: ", week);
+    std::snprintf(buf + n, sizeof(buf) - (size_t)n, fmt, a, b);
+    p.adjustments.emplace_back(buf);
+}
+
+static float week_load(const Plan& p, const Week& w) {
+    float sum = 0.0f;
+    for (uint32_t i = w.first; i < w.first + w.count; ++i) sum += p.sessions[i].load();
+    return sum;
+}
+
+static void scale_week(Plan& p, const Week& w, float f) {
+    for (uint32_t i = w.first; i < w.first + w.count; ++i) scale_session(p, p.sessions[i], f);
+}
+
+static void ensure_rest_days(Plan& p) {
+    if ((int)p.rest_days.size() > kMaxRestDays) {
+        p.rest_days.resize(kMaxRestDays);
+        p.adjustments.emplace_back("rest_days trimmed to 2");
+    }
+    if (!p.rest_days.empty()) return;
+    // First day not already scheduled in week 1.
+    static const char* const kDays[] = { "Sun", "Mon", "Fri", "Wed", "Thu", "Tue", "Sat" };
+    const char* day = kDays[0];
+    if (!p.weeks.empty()) {
+        const Week& w = p.weeks.front();
+        for (const char* d : kDays) {
+            bool used = false;
+            for (uint32_t i = w.first; i < w.first + w.count && !used; ++i)
+                used = !p.sessions[i].rest && has_word(p.str(p.sessions[i].text), d);
+            if (!used) { day = d; break; }
+        }
+    }
+    const Str s{ (uint32_t)p.text.size(), (uint32_t)std::strlen(day) };
+    p.text += day;
+    p.rest_days.push_back(s);
+    p.adjustments.emplace_back(std::string("inserted rest day ") + day);
+}
+
+static bool lower_body_injury(const Profile& pr, std::string* which) {
+    for (const std::string& inj : pr.injuries) {
+        if (!has_any(inj, kUpperBody)) { if (which) *which = inj; return true; }
+    }
+    return false;
+}
+
+static void swap_low_impact(Plan& p, Session& s) {
+    const std::string_view t = p.str(s.text);
+    const size_t colon = t.find(':');
+    const int    mins  = std::max(20, (int)std::lround(s.load()));
+    std::string r;
+    if (colon != std::string_view::npos && colon <= 12) r.append(t.substr(0, colon + 1)).append(" ");
+    r += "low-impact cross-training (bike or pool) ";
+    const size_t qoff = r.size();
+    r += std::to_string(mins);
+    const size_t qlen = r.size() - qoff;
+    r += " min";
+    s.text        = Str{ (uint32_t)p.text.size(), (uint32_t)r.size() };
+    s.qty_off     = (uint32_t)qoff;
+    s.qty_len     = (uint32_t)qlen;
+    s.qty         = (float)mins;
+    s.qty_lo      = 0.0f;
+    s.reps        = 1.0f;
+    s.unit        = Unit::Min;
+    s.high_impact = false;
+    p.text       += r;
+}
+
+void applyRules(Plan& p, const Profile& profile, size_t keep_weeks) {
+    ensure_rest_days(p);
+    const int max_training = 7 - (int)p.rest_days.size();
+
+    std::string injury;
+    const bool swap = lower_body_injury(profile, &injury);
+    int swapped = 0;
+
+    float base = 0.0f;   // load of the last non-deload week
+    float prev = 0.0f;
+    for (size_t wi = 0; wi < p.weeks.size(); ++wi) {
+        Week& w = p.weeks[wi];
+        const int expect = (int)wi + 1;
+        if (wi < keep_weeks) {
+            // already checked: only the injury swap applies, loads carry forward
+            if (swap) {
+                for (uint32_t i = w.first; i < w.first + w.count; ++i) {
+                    Session& s = p.sessions[i];
+                    if (s.high_impact && !s.dropped) { swap_low_impact(p, s); ++swapped; }
+                }
+            }
+            const float load = week_load(p, w);
+            if (load > 0.0f) { prev = load; if (expect % kDeloadEvery != 0) base = load; }
+            continue;
+        }
+        if (w.number != expect) { note(p, expect, "renumbered from %.0f", w.number); w.number = expect; }
+
+        // Training sessions beyond what the rest days leave room for.
+        int training = 0;
+        for (uint32_t i = w.first; i < w.first + w.count; ++i) {
+            Session& s = p.sessions[i];
+            if (s.rest) continue;
+            if (++training > max_training) { s.dropped = true; note(p, expect, "dropped a session beyond %.0f training days", max_training); }
+        }
+
+        if (swap) {
+            for (uint32_t i = w.first; i < w.first + w.count; ++i) {
+                Session& s = p.sessions[i];
+                if (s.high_impact && !s.dropped) { swap_low_impact(p, s); ++swapped; }
+            }
+        }
+
+        float load = week_load(p, w);
+        const bool deload = expect % kDeloadEvery == 0;
+        if (deload) {
+            if (prev > 0.0f && load > prev * kDeloadMax) {
+                const float f = prev * kDeloadTarget / load;
+                scale_week(p, w, f);
+                note(p, expect, "deload: volume cut to %.0f%% of previous week (was %.0f%%)",
+                     kDeloadTarget * 100.0, load / prev * 100.0);
+                load = week_load(p, w);
+            }
+        } else {
+            if (base > 0.0f && load > base * kMaxProgression) {
+                scale_week(p, w, base * kMaxProgression / load);
+                note(p, expect, "progression capped at +10%% (was +%.0f%%)", (load / base - 1.0f) * 100.0);
+                load = week_load(p, w);
+            }
+            if (load > 0.0f) base = load;
+        }
+        if (load > 0.0f) prev = load;
+    }
+    if (swapped > 0) {
+        p.adjustments.push_back(std::to_string(swapped) + " high-impact sessions swapped for low-impact work (" +
+                                injury + ")");
+    }
+}
+
+// ---- output ----
+
+static void put_str(std::string& o, std::string_view raw) {
+    o += '"'; o.append(raw); o += '"';
+}
+
+static void put_weeks(std::string& o, const Plan& p, size_t n) {
+    o += "{\"goal\":"; put_str(o, p.str(p.goal));
+    o += ",\"weeks\":[";
+    for (size_t wi = 0; wi < n; ++wi) {
+        const Week& w = p.weeks[wi];
+        if (wi) o += ',';
+        o += "{\"week\":"; o += std::to_string(w.number); o += ",\"sessions\":[";
+        bool first = true;
+        for (uint32_t i = w.first; i < w.first + w.count; ++i) {
+            if (p.sessions[i].dropped) continue;
+            if (!first) o += ',';
+            first = false;
+            put_str(o, p.str(p.sessions[i].text));
+        }
+        o += "]}";
+    }
+}
+
+std::string serializeHead(const Plan& p, size_t n_weeks) {
+    std::string o;
+    n_weeks = std::min(n_weeks, p.weeks.size());
+    o.reserve(64 + p.text.size());
+    put_weeks(o, p, n_weeks);
+    if (n_weeks) o += ',';
+    return o;
+}
+
+std::string serialize(const Plan& p) {
+    std::string o;
+    size_t est = 64 + p.text.size() + p.weeks.size() * 32 + p.sessions.size() * 4;
+    for (const std::string& a : p.adjustments) est += a.size() + 4;
+    o.reserve(est);
+
+    put_weeks(o, p, p.weeks.size());
+    o += "],\"rest_days\":[";
+    for (size_t i = 0; i < p.rest_days.size(); ++i) { if (i) o += ','; put_str(o, p.str(p.rest_days[i])); }
+    o += ']';
+    if (!p.adjustments.empty()) {
+        o += ",\"adjustments\":[";
+        for (size_t i = 0; i < p.adjustments.size(); ++i) { if (i) o += ','; put_str(o, p.adjustments[i]); }
+        o += ']';
+    }
+    o += '}';
+    return o;
 }
 
-std::string checkAndFixPlan(const std::string& json) {
-    if (json.empty() || json == "{}") return "{\"error\":\"invalid plan\"}";
-    // TODO: parse & enforce rules.
-    return ensureRestHint(json);
+std::string checkAndFixPlan(const std::string& json, const std::string& profile_json, size_t keep_weeks) {
+    Plan plan;
+    if (!parsePlan(json, plan)) return "{\"error\":\"invalid plan\"}";
+    applyRules(plan, parseProfile(profile_json), keep_weeks);
+    return serialize(plan);
 }
 
 } // namespace domain
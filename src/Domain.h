@@ -0,0 +1,80 @@
+// Domain.h
+// Typed training plan, parsed once from model JSON, and the coaching rules from
+// the system prompt (progression, rest days, deload, injuries) as check + repair.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace domain {
+
+// Slice of Plan::text. Strings stay JSON-escaped, exactly as the model wrote them,
+// so serializing is a copy.
+struct Str {
+    uint32_t off = 0;
+    uint32_t len = 0;
+};
+
+enum class Unit : uint8_t { None, Km, Mi, M, Min, Hr };
+
+struct Session {
+    Str      text;
+    uint32_t qty_off = 0;      // the volume figure inside text ("8" in "Sat: long run 8 km")
+    uint32_t qty_len = 0;      // 0 = no figure found
+    float    qty     = 0.0f;
+    float    qty_lo  = 0.0f;   // low end of a range ("10" in "10-12 km", span covers both); 0 = none
+    float    reps    = 1.0f;   // "6x400m" -> 6
+    Unit     unit    = Unit::None;
+    bool     rest        = false;
+    bool     high_impact = false;
+    bool     dropped     = false;
+
+    float load() const;        // minutes-equivalent volume (0 if unknown)
+};
+
+struct Week {
+    int      number = 0;
+    uint32_t first  = 0;       // index into Plan::sessions
+    uint32_t count  = 0;
+};
+
+// Flat layout: all strings live in one arena (identical strings share a slice),
+// all sessions of all weeks sit back to back in one vector.
+struct Plan {
+    std::string              text;
+    Str                      goal;
+    std::vector<Week>        weeks;
+    std::vector<Session>     sessions;
+    std::vector<Str>         rest_days;
+    std::vector<std::string> adjustments;   // already JSON-escaped
+
+    std::string_view str(Str s) const { return std::string_view(text.data() + s.off, s.len); }
+};
+
+struct Profile {
+    std::vector<std::string> injuries;      // lower-cased
+};
+
+// false if json is not an object with a non-empty "weeks" array.
+bool        parsePlan(std::string_view json, Plan& out);
+Profile     parseProfile(std::string_view json);
+
+// Enforce the prompt's constraints in one pass over the weeks; each repair is
+// recorded in plan.adjustments. The first keep_weeks were checked before and
+// only set the progression baseline, apart from injury swaps, which apply to every week.
+void        applyRules(Plan& plan, const Profile& profile, size_t keep_weeks = 0);
+
+std::string serialize(const Plan& plan);
+
+// serialize() cut after the first n_weeks weeks, open for more:
+// {"goal":...,"weeks":[{...},{...},   (no trailing comma when n_weeks is 0)
+std::string serializeHead(const Plan& plan, size_t n_weeks);
+
+// parse -> applyRules -> serialize; {"error":"invalid plan"} if it doesn't parse.
+std::string checkAndFixPlan(const std::string& json, const std::string& profile_json = {},
+                            size_t keep_weeks = 0);
+
+} // namespace domain
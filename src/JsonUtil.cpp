@@ -1,94 +1,552 @@
-// JsonUtil.cpp - robust JSON extraction & balancing
-#include <string>
+// JsonUtil.cpp - robust JSON extraction & balancing, SAX validator/tokenizer
+#include "JsonUtil.h"
 #include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace jsonutil {
 
-static inline std::string trim(std::string s) {
-    auto issp = [](unsigned char c){ return c==' '||c=='\t'||c=='\r'||c=='\n'; };
-    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [&](char c){ return !issp((unsigned char)c); }));
-    s.erase(std::find_if(s.rbegin(), s.rend(), [&](char c){ return !issp((unsigned char)c); }).base(), s.end());
-    return s;
+void JsonTracker::feed(char c) {
+    if (in_str) {
+        if (esc) { esc = false; return; }
+        if (c == '\\') { esc = true; return; }
+        if (c == '"') in_str = false;
+        return;
+    }
+    if (c == '"') { in_str = true; return; }
+    if (c == '{') ++curly;
+    else if (c == '}') { if (curly>0) --curly; }
+    else if (c == '[') ++square;
+    else if (c == ']') { if (square>0) --square; }
 }
 
-static inline void strip_bom(std::string& s) {
-    if (s.size() >= 3 && (unsigned char)s[0]==0xEF && (unsigned char)s[1]==0xBB && (unsigned char)s[2]==0xBF) {
-        s.erase(0,3);
+size_t JsonTracker::feedUntilClosed(std::string_view s) {
+    for (size_t i = 0; i < s.size(); ++i) {
+        const char c = s[i];
+        if (!started) {
+            if (c != '{') continue;
+            started = true;
+        }
+        feed(c);
+        if (curly == 0) return i + 1;
     }
+    return std::string_view::npos;
 }
 
-static inline void strip_code_fences(std::string& s) {
-    // remove ```...```; keep inner content
-    size_t a = s.find("```");
-    size_t b = s.rfind("```");
-    if (a != std::string::npos && b != std::string::npos && b > a) {
-        s = s.substr(a+3, b-(a+3));
+void ArrayElementScanner::feed(std::string_view s, const ElementFn& on_element) {
+    for (char c : s) {
+        if (capturing_) elem_ += c;
+        if (in_str_) {
+            if (esc_) { esc_ = false; }
+            else if (c == '\\') { esc_ = true; }
+            else if (c == '"') { in_str_ = false; if (stack_.size() == 1) last_str_ = str_; }
+            if (stack_.size() == 1 && in_str_) str_ += c;
+            continue;
+        }
+        switch (c) {
+        case '"':
+            in_str_ = true;
+            str_.clear();
+            break;
+        case ':':
+            if (stack_.size() == 1) cur_key_ = last_str_;
+            break;
+        case ',':
+            if (stack_.size() == 1) cur_key_.clear();
+            break;
+        case '{': case '[':
+            if (stack_.empty() && c != '{') break;   // root must be an object
+            if (stack_.size() == 1 && c == '[' && cur_key_ == key_) in_target_ = true;
+            else if (in_target_ && stack_.size() == 2 && !capturing_) {
+                capturing_ = true;
+                elem_.assign(1, c);
+            }
+            stack_ += c;
+            break;
+        case '}': case ']':
+            if (stack_.empty()) break;
+            stack_.pop_back();
+            if (capturing_ && stack_.size() == 2) {
+                capturing_ = false;
+                if (on_element) on_element(index_, elem_);
+                ++index_;
+            } else if (in_target_ && stack_.size() == 1) {
+                in_target_ = false;
+            }
+            break;
+        default:
+            break;
+        }
     }
 }
 
-static std::string balance_json_like(std::string s) {
-    // track {}, [] ignoring strings (simple heuristic)
-    int curly = 0, square = 0;
-    bool in_str = false, esc = false;
+// One left-to-right walk from the first '{': stops where the root object
+// closes, treats a stray ``` outside strings as the end of a fenced block, drops
+// commas that are followed (after whitespace) by '}' or ']', and closes whatever
+// is still open if the text was cut off. Input is copied into `out` in runs
+// between dropped commas; clean input is a single append.
+void extractFirstJson(std::string_view t, std::string& out) {
+    out.clear();
+    const size_t s = t.find('{');
+    if (s == std::string_view::npos) { out = "{}"; return; }
 
-    for (char c : s) {
+    constexpr int kMaxDepth = 128;
+    char        stack[kMaxDepth];    // open brackets, first kMaxDepth levels
+    std::string deep;                // the rest, only allocated for unusual nesting
+    int         depth  = 0;
+    bool   in_str = false, esc = false;
+    size_t comma  = std::string_view::npos;   // pending ',' not yet known to be valid
+    size_t from   = s;                        // start of the run not yet copied
+    size_t end    = t.size();
+    bool   closed = false;
+
+    out.reserve(t.size() - s + 8);
+    for (size_t i = s; i < t.size(); ++i) {
+        const char c = t[i];
         if (in_str) {
-            if (esc) { esc = false; continue; }
-            if (c == '\\') { esc = true; continue; }
-            if (c == '"') in_str = false;
+            if (esc) esc = false;
+            else if (c == '\\') esc = true;
+            else if (c == '"') in_str = false;
             continue;
         }
-        if (c == '"') { in_str = true; continue; }
-        if (c == '{') ++curly;
-        else if (c == '}') { if (curly>0) --curly; }
-        else if (c == '[') ++square;
-        else if (c == ']') { if (square>0) --square; }
-    }
-    // append missing closers in correct order: close arrays first if they are open at tail
-    std::string tail;
-    while (square-- > 0) tail += ']';
-    while (curly--  > 0) tail += '}';
-    s += tail;
-    return s;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') continue;
+        if (c == '`') { end = i; break; }   // closing code fence
+
+        if (comma != std::string_view::npos) {
+            if (c == '}' || c == ']') {          // trailing comma: skip it
+                out.append(t.data() + from, comma - from);
+                from = comma + 1;
+            }
+            comma = std::string_view::npos;
+        }
+        switch (c) {
+        case '"': in_str = true; break;
+        case ',': comma = i; break;
+        case '{': case '[':
+            if (depth < kMaxDepth) stack[depth] = c; else deep += c;
+            ++depth;
+            break;
+        case '}': case ']':
+            if (depth > kMaxDepth) deep.pop_back();
+            if (depth > 0) --depth;
+            if (depth == 0) { end = i + 1; closed = true; }
+            break;
+        default: break;
+        }
+        if (closed) break;
+    }
+
+    if (!closed) {
+        // Truncated: back off trailing whitespace and a dangling comma.
+        while (end > from && (t[end-1] == ' ' || t[end-1] == '\t' || t[end-1] == '\r' || t[end-1] == '\n')) --end;
+        if (!in_str && comma != std::string_view::npos && comma + 1 == end) end = comma;
+    }
+    out.append(t.data() + from, end - from);
+    if (closed) return;
+
+    if (in_str) { if (esc) out.pop_back(); out += '"'; }
+    while (depth > 0) {
+        --depth;
+        const char open = depth < kMaxDepth ? stack[depth] : deep[(size_t)(depth - kMaxDepth)];
+        out += open == '[' ? ']' : '}';
+    }
+}
+
+std::string extractFirstJson(std::string_view text) {
+    std::string out;
+    extractFirstJson(text, out);
+    return out;
+}
+
+// ---- SAX parser ----
+
+namespace {
+
+inline bool is_ws(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+// First byte in [p, end) that needs attention inside a string: '"', '\\' or a
+// control character. 16 bytes per step with SSE2 / NEON.
+const char* scan_string(const char* p, const char* end) {
+#if defined(__SSE2__)
+    const __m128i q  = _mm_set1_epi8('"');
+    const __m128i bs = _mm_set1_epi8('\\');
+    const __m128i sp = _mm_set1_epi8(0x1F);
+    for (; p + 16 <= end; p += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)p);
+        const __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, sp), v);   // v <= 0x1F
+        const int m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, q),
+                                                                  _mm_cmpeq_epi8(v, bs)), ctl));
+        if (m) return p + __builtin_ctz((unsigned)m);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t q  = vdupq_n_u8('"');
+    const uint8x16_t bs = vdupq_n_u8('\\');
+    const uint8x16_t sp = vdupq_n_u8(0x20);
+    for (; p + 16 <= end; p += 16) {
+        const uint8x16_t v = vld1q_u8((const uint8_t*)p);
+        const uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, q), vceqq_u8(v, bs)), vcltq_u8(v, sp));
+        if (vmaxvq_u8(m)) break;   // finish this block byte by byte
+    }
+#endif
+    for (; p < end; ++p) {
+        const unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\' || c < 0x20) return p;
+    }
+    return end;
+}
+
+inline int hex_val(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
 }
 
-// Extract first `{...}` and auto-balance if truncated
-std::string extractFirstJson(const std::string& raw) {
-    std::string t = raw;
-    strip_bom(t);
-    strip_code_fences(t);
-    t = trim(t);
-
-    size_t s = t.find('{');
-    if (s == std::string::npos) return "{}";
-
-    // cut from first '{' to the best stopping point: first '}\n' or end
-    size_t e = t.find("\n}\n", s);
-    if (e != std::string::npos) {
-        std::string cand = t.substr(s, e - s + 2);
-        return trim(balance_json_like(cand));
-    }
-    // otherwise take until last } or whole remainder
-    size_t last = t.find_last_of('}');
-    std::string cand = (last != std::string::npos && last > s) ? t.substr(s, last - s + 1) : t.substr(s);
-    // remove trailing ",}" / ",]" patterns
-    auto fix_trailing_commas = [](std::string& x){
+class Parser {
+public:
+    Parser(std::string_view s, JsonHandler* h) : p_(s.data()), begin_(s.data()), end_(s.data() + s.size()), h_(h) {}
+
+    bool run(JsonError* err) {
+        const bool ok = parse();
+        if (!ok && err) { err->offset = (size_t)(p_ - begin_); err->what = what_; }
+        return ok;
+    }
+
+private:
+    static constexpr int kMaxDepth = 512;
+
+    bool fail(const char* what) { what_ = what; return false; }
+
+    void skip_ws() { while (p_ < end_ && is_ws(*p_)) ++p_; }
+
+    bool push(bool is_array) {
+        if (depth_ >= kMaxDepth) return fail("nesting too deep");
+        const uint64_t bit = 1ull << (depth_ & 63);
+        if (is_array) arrays_[depth_ >> 6] |= bit; else arrays_[depth_ >> 6] &= ~bit;
+        ++depth_;
+        return true;
+    }
+    bool top_is_array() const { return (arrays_[(depth_ - 1) >> 6] >> ((depth_ - 1) & 63)) & 1; }
+
+    // p_ at the opening quote; leaves p_ past the closing one.
+    bool string(std::string_view& out) {
+        const char* start = ++p_;
         for (;;) {
-            bool changed = false;
-            for (size_t p=0; (p = x.find(",}")) != std::string::npos; ) { x.erase(p,1); changed = true; }
-            for (size_t p=0; (p = x.find(",]")) != std::string::npos; ) { x.erase(p,1); changed = true; }
-            if (!changed) break;
+            p_ = scan_string(p_, end_);
+            if (p_ == end_) return fail("unterminated string");
+            const char c = *p_;
+            if (c == '"') break;
+            if ((unsigned char)c < 0x20) return fail("control character in string");
+            // backslash
+            if (++p_ == end_) return fail("unterminated string");
+            switch (*p_) {
+            case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                ++p_;
+                break;
+            case 'u':
+                if (end_ - p_ < 5) return fail("bad \\u escape");
+                for (int i = 1; i <= 4; ++i) if (hex_val(p_[i]) < 0) return fail("bad \\u escape");
+                p_ += 5;
+                break;
+            default:
+                return fail("bad escape");
+            }
+        }
+        out = std::string_view(start, (size_t)(p_ - start));
+        ++p_;
+        return true;
+    }
+
+    bool number() {
+        const char* start = p_;
+        if (p_ < end_ && *p_ == '-') ++p_;
+        if (p_ == end_) return fail("bad number");
+        if (*p_ == '0') ++p_;
+        else if (*p_ >= '1' && *p_ <= '9') { while (p_ < end_ && *p_ >= '0' && *p_ <= '9') ++p_; }
+        else return fail("bad number");
+        if (p_ < end_ && *p_ == '.') {
+            ++p_;
+            if (p_ == end_ || *p_ < '0' || *p_ > '9') return fail("bad number");
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') ++p_;
+        }
+        if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+            ++p_;
+            if (p_ < end_ && (*p_ == '+' || *p_ == '-')) ++p_;
+            if (p_ == end_ || *p_ < '0' || *p_ > '9') return fail("bad number");
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') ++p_;
+        }
+        return !h_ || h_->number(std::string_view(start, (size_t)(p_ - start))) || fail("aborted");
+    }
+
+    bool literal(const char* word, size_t n) {
+        if ((size_t)(end_ - p_) < n || std::string_view(p_, n) != std::string_view(word, n))
+            return fail("bad literal");
+        p_ += n;
+        return true;
+    }
+
+    // Scalar or container opener at p_ (after whitespace).
+    bool value() {
+        if (p_ == end_) return fail("expected value");
+        std::string_view sv;
+        switch (*p_) {
+        case '{': ++p_; return push(false) && (!h_ || h_->startObject() || fail("aborted"));
+        case '[': ++p_; return push(true)  && (!h_ || h_->startArray()  || fail("aborted"));
+        case '"': return string(sv) && (!h_ || h_->string(sv) || fail("aborted"));
+        case 't': return literal("true", 4)  && (!h_ || h_->boolean(true)  || fail("aborted"));
+        case 'f': return literal("false", 5) && (!h_ || h_->boolean(false) || fail("aborted"));
+        case 'n': return literal("null", 4)  && (!h_ || h_->null() || fail("aborted"));
+        default:
+            if (*p_ == '-' || (*p_ >= '0' && *p_ <= '9')) return number();
+            return fail("expected value");
+        }
+    }
+
+    bool close() {
+        const bool arr = top_is_array();
+        --depth_;
+        ++p_;
+        return !h_ || (arr ? h_->endArray() : h_->endObject()) || fail("aborted");
+    }
+
+    bool member_key() {
+        if (p_ == end_ || *p_ != '"') return fail("expected key");
+        std::string_view k;
+        if (!string(k)) return false;
+        if (h_ && !h_->key(k)) return fail("aborted");
+        skip_ws();
+        if (p_ == end_ || *p_ != ':') return fail("expected ':'");
+        ++p_;
+        skip_ws();
+        return true;
+    }
+
+    // Iterative: the only state between tokens is the open-container bit stack.
+    bool parse() {
+        skip_ws();
+        if (!value()) return false;
+        bool fresh = depth_ > 0;   // just opened a container: allow an immediate close
+        while (depth_ > 0) {
+            skip_ws();
+            if (p_ == end_) return fail("unexpected end");
+            const bool arr = top_is_array();
+            if (fresh) {
+                fresh = false;
+                if (*p_ == (arr ? ']' : '}')) { if (!close()) return false; continue; }
+            } else if (*p_ == ',') {
+                ++p_;
+                skip_ws();
+            } else if (*p_ == (arr ? ']' : '}')) {
+                if (!close()) return false;
+                continue;
+            } else {
+                return fail(arr ? "expected ',' or ']'" : "expected ',' or '}'");
+            }
+            if (!arr && !member_key()) return false;
+            const int d = depth_;
+            if (!value()) return false;
+            fresh = depth_ > d;
+        }
+        skip_ws();
+        return p_ == end_ || fail("trailing characters");
+    }
+
+    const char*  p_;
+    const char*  begin_;
+    const char*  end_;
+    JsonHandler* h_;
+    int          depth_ = 0;
+    uint64_t     arrays_[kMaxDepth / 64] = {};
+    const char*  what_ = nullptr;
+};
+
+void put_utf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) out += (char)cp;
+    else if (cp < 0x800) { out += (char)(0xC0 | (cp >> 6)); out += (char)(0x80 | (cp & 0x3F)); }
+    else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+} // namespace
+
+bool parseJson(std::string_view s, JsonHandler* h, JsonError* err) {
+    return Parser(s, h).run(err);
+}
+
+std::string unescape(std::string_view raw) {
+    std::string out;
+    out.reserve(raw.size());
+    for (size_t i = 0; i < raw.size(); ++i) {
+        const char c = raw[i];
+        if (c != '\\' || i + 1 == raw.size()) { out += c; continue; }
+        const char e = raw[++i];
+        switch (e) {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            auto hex4 = [&](size_t at) -> int {
+                if (at + 4 > raw.size()) return -1;
+                int v = 0;
+                for (size_t k = at; k < at + 4; ++k) {
+                    const int h = hex_val(raw[k]);
+                    if (h < 0) return -1;
+                    v = v * 16 + h;
+                }
+                return v;
+            };
+            int cp = hex4(i + 1);
+            if (cp < 0) { out += e; break; }
+            i += 4;
+            if (cp >= 0xD800 && cp < 0xDC00 && i + 2 < raw.size() && raw[i+1] == '\\' && raw[i+2] == 'u') {
+                const int lo = hex4(i + 3);
+                if (lo >= 0xDC00 && lo < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    i += 6;
+                }
+            }
+            put_utf8(out, (uint32_t)cp);
+            break;
+        }
+        default: out += e; break;   // '"', '\\', '/'
         }
+    }
+    return out;
+}
+
+std::string escape(std::string_view text) {
+    static const char kHex[] = "0123456789abcdef";
+    std::string o;
+    o.reserve(text.size() + 8);
+    for (const char ch : text) {
+        const unsigned char c = (unsigned char)ch;
+        switch (c) {
+        case '"':  o += "\\\""; break;
+        case '\\': o += "\\\\"; break;
+        case '\n': o += "\\n";  break;
+        case '\r': o += "\\r";  break;
+        case '\t': o += "\\t";  break;
+        default:
+            if (c < 0x20) { o += "\\u00"; o += kHex[c >> 4]; o += kHex[c & 15]; }
+            else o += ch;
+        }
+    }
+    return o;
+}
+
+bool looksLikeJson(std::string_view s) {
+    size_t l = 0;
+    while (l < s.size() && is_ws(s[l])) ++l;
+    return l < s.size() && s[l] == '{' && parseJson(s);
+}
+
+namespace {
+
+// Builds each container's canonical text bottom-up; only open containers are held.
+// With sort off it just compacts, and keeps the root object's members.
+struct Canonicalizer : JsonHandler {
+    using Members = std::vector<std::pair<std::string, std::string>>;
+    struct Frame {
+        bool        object = false;
+        Members     members;   // object: raw key -> value
+        std::string items;     // array: joined values
+        std::string key;
     };
-    fix_trailing_commas(cand);
-    return trim(balance_json_like(cand));
+    std::vector<Frame> stack;
+    std::string        root;
+    bool               sort = true;
+    Members            root_members;
+
+    void value(std::string v) {
+        if (stack.empty()) { root = std::move(v); return; }
+        Frame& f = stack.back();
+        if (f.object) { f.members.emplace_back(std::move(f.key), std::move(v)); return; }
+        if (!f.items.empty()) f.items += ',';
+        f.items += v;
+    }
+
+    bool startObject() override { stack.emplace_back(); stack.back().object = true; return true; }
+    bool startArray()  override { stack.emplace_back(); return true; }
+    bool endObject() override {
+        Frame f = std::move(stack.back());
+        stack.pop_back();
+        if (sort)
+            std::stable_sort(f.members.begin(), f.members.end(),
+                             [](const auto& a, const auto& b) { return a.first < b.first; });
+        if (stack.empty() && !sort) { root_members = std::move(f.members); return true; }
+        std::string o = "{";
+        for (size_t i = 0; i < f.members.size(); ++i) {
+            if (i) o += ',';
+            o += '"'; o += f.members[i].first; o += "\":"; o += f.members[i].second;
+        }
+        o += '}';
+        value(std::move(o));
+        return true;
+    }
+    bool endArray() override {
+        std::string o = "[" + stack.back().items + "]";
+        stack.pop_back();
+        value(std::move(o));
+        return true;
+    }
+    bool key(std::string_view k) override     { stack.back().key.assign(k); return true; }
+    bool string(std::string_view s) override  { value("\"" + std::string(s) + "\""); return true; }
+    bool number(std::string_view n) override  { value(std::string(n)); return true; }
+    bool boolean(bool b) override             { value(b ? "true" : "false"); return true; }
+    bool null() override                      { value("null"); return true; }
+};
+
+} // namespace
+
+bool canonicalize(std::string_view s, std::string& out) {
+    Canonicalizer c;
+    if (!parseJson(s, &c)) return false;
+    out = std::move(c.root);
+    return true;
+}
+
+static bool object_members(std::string_view s, Canonicalizer& c) {
+    size_t l = 0;
+    while (l < s.size() && is_ws(s[l])) ++l;
+    c.sort = false;
+    return l < s.size() && s[l] == '{' && parseJson(s, &c);
 }
 
-bool looksLikeJson(const std::string& s) {
-    if (s.size() < 2) return false;
-    size_t l = s.find_first_not_of(" \t\r\n");
-    size_t r = s.find_last_not_of(" \t\r\n");
-    return l != std::string::npos && r != std::string::npos && s[l]=='{' && s[r]=='}';
+bool mergePatch(std::string_view base, std::string_view patch, std::string& out) {
+    Canonicalizer b, p;
+    if (!object_members(base, b) || !object_members(patch, p)) return false;
+    Canonicalizer::Members& m = b.root_members;
+    for (auto& kv : p.root_members) {
+        auto it = std::find_if(m.begin(), m.end(), [&](const auto& e) { return e.first == kv.first; });
+        if (kv.second == "null") { if (it != m.end()) m.erase(it); }
+        else if (it != m.end())  it->second = std::move(kv.second);
+        else                     m.push_back(std::move(kv));
+    }
+    out = "{";
+    for (size_t i = 0; i < m.size(); ++i) {
+        if (i) out += ',';
+        out += '"'; out += m[i].first; out += "\":"; out += m[i].second;
+    }
+    out += '}';
+    return true;
 }
 
 } // namespace jsonutil
@@ -0,0 +1,100 @@
+// JsonUtil.h - robust JSON extraction & balancing, SAX validator/tokenizer
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace jsonutil {
+
+// Incremental {} / [] depth tracker that ignores brackets inside strings.
+// Same state machine the balancer uses, fed piece by piece while decoding.
+struct JsonTracker {
+    int  curly   = 0;
+    int  square  = 0;
+    bool in_str  = false;
+    bool esc     = false;
+    bool started = false;   // first '{' seen (text before it is ignored)
+
+    void feed(char c);
+
+    // Feed a piece; returns the offset just past the '}' that closes the root
+    // object, or npos while it is still open.
+    size_t feedUntilClosed(std::string_view s);
+
+    bool rootClosed() const { return started && curly == 0; }
+};
+
+// Streams text through and reports every object/array element of the root
+// object's `key` array (e.g. "weeks") the moment its closing bracket arrives.
+class ArrayElementScanner {
+public:
+    using ElementFn = std::function<void(int index, const std::string& element_json)>;
+
+    explicit ArrayElementScanner(std::string key) : key_(std::move(key)) {}
+
+    void feed(std::string_view s, const ElementFn& on_element);
+
+private:
+    std::string key_;
+    std::string stack_;            // open brackets, outermost first
+    bool        in_str_  = false;
+    bool        esc_     = false;
+    std::string str_;              // current root-level string (key candidate)
+    std::string last_str_;
+    std::string cur_key_;          // key whose value is being read at root level
+    bool        in_target_ = false;
+    std::string elem_;             // element being captured
+    bool        capturing_ = false;
+    int         index_     = 0;
+};
+
+// First `{...}` in model output (code fences / chatter around it ignored), with
+// trailing commas removed and missing closers appended if it was cut off.
+// The out-param form reuses the caller's buffer.
+void        extractFirstJson(std::string_view text, std::string& out);
+std::string extractFirstJson(std::string_view text);
+// SAX events from parseJson. Strings arrive raw (between the quotes, escapes
+// intact); use unescape() when the decoded text is needed. Returning false from
+// any callback stops the parse, which then reports failure.
+struct JsonHandler {
+    virtual ~JsonHandler() = default;
+    virtual bool startObject()                { return true; }
+    virtual bool endObject()                  { return true; }
+    virtual bool startArray()                 { return true; }
+    virtual bool endArray()                   { return true; }
+    virtual bool key(std::string_view)        { return true; }
+    virtual bool string(std::string_view)     { return true; }
+    virtual bool number(std::string_view)     { return true; }
+    virtual bool boolean(bool)                { return true; }
+    virtual bool null()                       { return true; }
+};
+
+struct JsonError {
+    size_t      offset = 0;
+    const char* what   = nullptr;   // static string
+};
+
+// Strict RFC 8259 parse of exactly one value (whitespace around it allowed), no
+// tree built. Max nesting depth 512. UTF-8 inside strings is not validated.
+bool parseJson(std::string_view s, JsonHandler* h = nullptr, JsonError* err = nullptr);
+
+// Decodes JSON string escapes (\n, \uXXXX incl. surrogate pairs) to UTF-8.
+std::string unescape(std::string_view raw);
+// The reverse, for text going between quotes: '"', '\\' and control characters.
+std::string escape(std::string_view text);
+
+// A complete, well-formed JSON object.
+bool        looksLikeJson(std::string_view s);
+
+// Canonical form for use as a cache key: no insignificant whitespace, object
+// members sorted by key (byte order of the raw key), strings and numbers kept
+// as written. false (out unspecified) if s does not parse.
+bool        canonicalize(std::string_view s, std::string& out);
+
+// RFC 7386 merge patch, top level only: patch members replace or add to base's
+// (in base's order, new keys last), a null member removes the key. Output is
+// compact. false if either side is not a JSON object.
+bool        mergePatch(std::string_view base, std::string_view patch, std::string& out);
+
+} // namespace jsonutil
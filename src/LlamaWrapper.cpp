@@ -5,151 +5,1450 @@
 //  - piece:    llama_token_to_piece(vocab, token, buf, len, lstrip, special)  // 6 args
 //  - decode:   llama_batch + llama_decode (manual fill), no llama_eval
 
+#include "LlamaWrapper.h"
+#include "JsonUtil.h"
+#include "Metrics.h"
+#include "Sampler.h"
 #include "llama.h"
+#include "ggml-cpu.h"
 #include <string>
 #include <vector>
 #include <stdexcept>
-#include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <deque>
+#include <cmath>
+#include <utility>
+#include <thread>
+#include <fstream>
+#include <set>
+#include <unordered_map>
+#include <sstream>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <dirent.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace lw {
 
-static llama_model*         g_model = nullptr;
-static llama_context*       g_ctx   = nullptr;
-static const llama_vocab*   g_vocab = nullptr;
+// ---- Process-wide backend lifetime (refcounted by loaded models) ----
+static std::mutex g_backend_mu;
+static int        g_backend_refs = 0;
+
+static void backend_acquire(Numa numa) {
+    std::lock_guard<std::mutex> lk(g_backend_mu);
+    if (g_backend_refs++ == 0) {
+        llama_backend_init();
+        if (numa != Numa::Disabled) llama_numa_init((ggml_numa_strategy)numa);
+    }
+}
+
+static void backend_release() {
+    std::lock_guard<std::mutex> lk(g_backend_mu);
+    if (--g_backend_refs == 0) llama_backend_free();
+}
+
+// Token history of one sequence (prefix + prompt + output) with, for every
+// n-gram of kLookupMinN..kLookupMaxN tokens, the end position of its latest
+// occurrence. An n-gram is indexed only once a token follows it, so a hit
+// always has a continuation to draft from.
+struct NgramIndex {
+    static constexpr int kLookupMinN = 2;
+    static constexpr int kLookupMaxN = 4;
+
+    std::vector<llama_token>          toks;
+    std::unordered_map<uint64_t, int> last;
+
+    static uint64_t key(const llama_token* t, int n) {
+        uint64_t h = (uint64_t)n * 0x9E3779B97F4A7C15ull;
+        for (int i = 0; i < n; ++i) h = (h ^ (uint32_t)t[i]) * 0x100000001B3ull;
+        return h;
+    }
+
+    void clear() { toks.clear(); last.clear(); }
+
+    void push(llama_token t) {
+        const int end = (int)toks.size() - 1;   // n-grams ending here are now followed by t
+        for (int n = kLookupMinN; n <= kLookupMaxN && end + 1 >= n; ++n)
+            last[key(&toks[end + 1 - n], n)] = end;
+        toks.push_back(t);
+    }
+
+    // Longest-n match of the current tail; copies up to k following tokens.
+    void draft(int k, std::vector<llama_token>& out) const {
+        const int L = (int)toks.size() - 1;
+        for (int n = std::min(kLookupMaxN, L + 1); n >= kLookupMinN; --n) {
+            const auto it = last.find(key(&toks[L + 1 - n], n));
+            if (it == last.end()) continue;
+            for (int i = it->second + 1; i <= L && (int)out.size() < k; ++i) out.push_back(toks[i]);
+            return;
+        }
+    }
+};
+
+struct Slot {
+    llama_seq_id             seq     = 0;
+    int                      req     = -1;   // request index, -1 = free
+    int                      n_past  = 0;
+    int                      n_gen   = 0;
+    int                      i_batch = -1;   // logits row in the current batch
+    int                      n_feed  = 0;    // tokens this slot put in the current batch
+    llama_token              next    = 0;    // sampled, not yet decoded
+    llama_sampler*           grammar = nullptr;   // per-sequence grammar state
+    jsonutil::JsonTracker    json;                // root-object close detection
+    sampling::Sampler        smp;
+    std::vector<llama_token> prompt;         // prompt tokens after the shared prefix
+    size_t                   i_prompt = 0;   // prompt[0, i_prompt) is already decoded
+    int                      n_base   = 0;   // position of prompt[0]
+
+    // Pending fork: once slot fork_src (still serving fork_req) has decoded
+    // prompt[0, fork_len), share those cells instead of decoding them again.
+    int                      fork_src = -1;
+    int                      fork_req = -1;
+    size_t                   fork_len = 0;
+
+    // Speculation: the draft KV holds positions [0, d_past); d_pending are tokens
+    // the main model has committed past that. drafts go into the next batch after `next`.
+    int                      d_past  = 0;
+    int                      n_spec  = 0;    // drafts wanted this step
+    int                      d_row   = -1;   // logits row in the draft batch
+    std::vector<llama_token> d_pending;
+    std::vector<llama_token> drafts;
+    NgramIndex               lookup;         // only filled when n-gram lookup is on
+
+    bool prefilling() const { return i_prompt < prompt.size(); }
+};
+
+// Everything one llama_context needs to run the engine. Only the thread holding
+// the context touches it; the model/vocab behind it are shared read-only.
+struct ContextState {
+    std::shared_ptr<Model> model;
+    const llama_vocab*     vocab      = nullptr;
+    llama_context*         ctx        = nullptr;
+    int                    n_parallel = 1;   // decode slots; they use seq ids 1..n
+
+    // One batch sized to the context's n_batch, allocated at create and reused by
+    // every decode. Prompts are streamed through it in chunks of prefill_chunk tokens.
+    llama_batch            batch         = {};
+    int                    batch_cap     = 0;
+    int                    prefill_chunk = 0;
+
+    // System prefix kept resident in seq 0's KV cache (positions [0, n)).
+    // Slots fork it with llama_kv_cache_seq_cp, which shares the cells.
+    std::string              prefix_text;
+    std::vector<llama_token> prefix_toks;
+    bool                     prefix_resident = false;
+    // Constant prompt tail, appended as tokens instead of re-tokenized.
+    std::string              suffix_text;
+    std::vector<llama_token> suffix_toks;
+
+    // Compiled grammar, never fed a token itself; each slot decodes with a clone.
+    llama_sampler*                grammar = nullptr;
+    std::vector<llama_token_data> cand;     // full-vocab scratch for grammar masking
+    std::vector<float>            masked;
+
+    // Pinned ggml worker pools (only when ContextParams::cpus is set).
+    ggml_threadpool*              tp       = nullptr;
+    ggml_threadpool*              tp_batch = nullptr;
 
-static int argmax(const float* logits, int n_vocab) {
-    int best = 0; float v = logits[0];
-    for (int i = 1; i < n_vocab; ++i) if (logits[i] > v) { v = logits[i]; best = i; }
-    return best;
+    // Draft model context for speculative decoding, same seq layout as ctx
+    // (seq 0 = prefix, slots 1..n). n_draft == 0 means speculation is off.
+    std::shared_ptr<Model>        draft_model;
+    llama_context*                dctx       = nullptr;
+    llama_batch                   dbatch     = {};
+    int                           dbatch_cap = 0;
+    int                           n_draft    = 0;
+    int                           n_lookup   = 0;   // n-gram lookup drafts when n_draft == 0
+    std::atomic<uint64_t>         n_drafted{0};
+    std::atomic<uint64_t>         n_accepted{0};
+
+    // Decode slots (and the token/index buffers inside them), reused across
+    // engine runs; slot_start resets everything request-specific.
+    std::vector<Slot>             slots;
+
+    ~ContextState() {
+        if (dbatch_cap) llama_batch_free(dbatch);
+        if (dctx)       llama_free(dctx);
+        if (grammar)   llama_sampler_free(grammar);
+        if (batch_cap) llama_batch_free(batch);
+        if (ctx)       llama_free(ctx);
+        if (tp_batch)  ggml_threadpool_free(tp_batch);
+        if (tp)        ggml_threadpool_free(tp);
+    }
+};
+
+static bool grammar_allows(llama_sampler* grammar, int tok, float logit) {
+    llama_token_data one = { tok, logit, 0.0f };
+    llama_token_data_array arr = { &one, 1, -1, false };
+    llama_sampler_apply(grammar, &arr);
+    return std::isfinite(one.logit);
 }
 
-static std::string token_to_piece(llama_token tok) {
+// Sample with the slot's sampler; under a grammar, check the pick first (usually
+// legal once the model follows the schema) and only mask the full vocab and
+// resample on rejection.
+static int sample_token(ContextState& c, sampling::Sampler& smp, llama_sampler* grammar,
+                        const float* logits, int n_vocab) {
+    const int tok = smp.sample(logits, n_vocab);
+    if (!grammar || (tok >= 0 && grammar_allows(grammar, tok, logits[tok]))) return tok;
+
+    c.cand.resize(n_vocab);
+    for (int i = 0; i < n_vocab; ++i) c.cand[i] = { i, logits[i], 0.0f };
+    llama_token_data_array arr = { c.cand.data(), c.cand.size(), -1, false };
+    llama_sampler_apply(grammar, &arr);
+    c.masked.resize(n_vocab);
+    for (int i = 0; i < n_vocab; ++i) c.masked[i] = c.cand[i].logit;
+    const int pick = smp.sample(c.masked.data(), n_vocab);
+    return (pick >= 0 && std::isfinite(c.masked[pick])) ? pick : -1;   // -1: grammar admits nothing
+}
+
+// Appends tok's text to out; only used to build Model's piece table.
+static void append_piece(const llama_vocab* vocab, llama_token tok, std::string& out) {
     char buf[512];
-    int n = llama_token_to_piece(g_vocab, tok, buf, (int)sizeof(buf),
+    int n = llama_token_to_piece(vocab, tok, buf, (int)sizeof(buf),
                                  /*lstrip*/ 0, /*special*/ true);
-    if (n <= 0) return {};
-    if (n < (int)sizeof(buf)) return std::string(buf, buf + n);
-    std::string s; s.resize(n);
-    llama_token_to_piece(g_vocab, tok, &s[0], n, /*lstrip*/ 0, /*special*/ true);
-    return s;
+    if (n > 0) { out.append(buf, (size_t)n); return; }
+    if (n == 0) return;
+    const size_t at = out.size();   // n < 0: piece needs -n bytes
+    out.resize(at + (size_t)-n);
+    n = llama_token_to_piece(vocab, tok, &out[at], -n, /*lstrip*/ 0, /*special*/ true);
+    out.resize(at + (size_t)std::max(0, n));
 }
 
-bool init(const std::string& model_path, int n_ctx /*=2048*/, int n_gpu_layers /*=0*/) {
-    if (g_ctx) return true;
+// Chat templates such as llama3 or gemma render the BOS text themselves, and
+// parse_special turns it into the BOS token; adding one on top would double it.
+static bool starts_with_bos(const llama_vocab* vocab, std::string_view text) {
+    const llama_token bos = llama_vocab_bos(vocab);
+    if (bos < 0 || !llama_vocab_get_add_bos(vocab)) return false;
+    std::string piece;
+    append_piece(vocab, bos, piece);
+    return !piece.empty() && text.compare(0, piece.size(), piece) == 0;
+}
+
+// Appends the tokens of text to out. add_special lets the vocab add BOS (only
+// if it wants one and the text doesn't already start with it), so callers never
+// prepend it themselves. A token is never shorter than a byte, so
+// text.size() + 2 is enough room in practice; if not, llama_tokenize reports
+// the exact count and we retry once.
+static void tokenize_into(const llama_vocab* vocab, std::string_view text, bool add_special,
+                          std::vector<llama_token>& out) {
+    if (add_special && starts_with_bos(vocab, text)) add_special = false;
+    const size_t base = out.size();
+    out.resize(base + text.size() + 2);
+    int n_tok = llama_tokenize(vocab, text.data(), (int)text.size(), out.data() + base,
+                               (int)(out.size() - base), add_special, /*parse_special*/ true);
+    if (n_tok < 0) {
+        out.resize(base + (size_t)-n_tok);
+        n_tok = llama_tokenize(vocab, text.data(), (int)text.size(), out.data() + base,
+                               (int)(out.size() - base), add_special, /*parse_special*/ true);
+        if (n_tok < 0) { out.resize(base); throw std::runtime_error("tokenize failed"); }
+    }
+    out.resize(base + (size_t)n_tok);
+}
+
+static int batch_add(llama_batch& batch, llama_token tok, llama_pos pos, llama_seq_id seq, bool logits) {
+    int idx = batch.n_tokens++;
+    batch.token[idx]     = tok;
+    batch.pos[idx]       = pos;
+    batch.n_seq_id[idx]  = 1;
+    batch.seq_id[idx][0] = seq;
+    batch.logits[idx]    = logits;
+    return idx;
+}
+
+// Decode toks at positions [pos0, pos0 + n) of seq 0, one chunk per llama_decode.
+static bool feed(llama_context* ctx, llama_batch& batch, int chunk, const std::vector<llama_token>& toks, int pos0) {
+    for (size_t i = 0; i < toks.size(); ) {
+        const size_t n = std::min(toks.size() - i, (size_t)chunk);
+        batch.n_tokens = 0;
+        for (size_t j = 0; j < n; ++j)
+            batch_add(batch, toks[i + j], pos0 + (int)(i + j), 0, false);
+        if (llama_decode(ctx, batch) != 0) return false;
+        i += n;
+    }
+    return true;
+}
+
+static void drop_draft(ContextState& c, const char* why) {
+    if (c.n_draft > 0) std::cerr << "[lw] speculative decoding off: " << why << "\n";
+    c.n_draft = 0;
+}
+
+// The draft context mirrors the prefix so slots can fork it the same way.
+static void prime_draft_prefix(ContextState& c) {
+    if (c.n_draft == 0) return;
+    llama_kv_cache_seq_rm(c.dctx, 0, 0, -1);
+    if (!feed(c.dctx, c.dbatch, std::min(c.prefill_chunk, c.dbatch_cap), c.prefix_toks, 0))
+        drop_draft(c, "draft prefix decode failed");
+}
+
+static bool prime_prefix(ContextState& c) {
+    llama_kv_cache_seq_rm(c.ctx, 0, 0, -1);
+    c.prefix_resident = feed(c.ctx, c.batch, c.prefill_chunk, c.prefix_toks, 0);
+    if (c.prefix_resident) prime_draft_prefix(c);
+    return c.prefix_resident;
+}
 
-    llama_backend_init();
+// [BOS] + prefix tokens, or empty if the prefix can't be kept resident.
+// Tokenized once per setPrefix; requests only tokenize what follows it.
+static std::vector<llama_token> prefix_tokens(const ContextState& c, const std::string& prefix) {
+    std::vector<llama_token> toks;
+    tokenize_into(c.vocab, prefix, /*add_special*/ true, toks);
+    if (toks.empty() || (int)toks.size() >= (int)llama_n_ctx(c.ctx)) toks.clear();
+    return toks;
+}
+
+// ---- CPU topology ----
+
+std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        if (part.empty()) continue;
+        int a = 0, b = 0;
+        const size_t dash = part.find('-');
+        try {
+            a = std::stoi(part.substr(0, dash));
+            b = dash == std::string::npos ? a : std::stoi(part.substr(dash + 1));
+        } catch (const std::exception&) {
+            return {};
+        }
+        if (a < 0 || b < a || b >= GGML_MAX_N_THREADS) return {};
+        for (int i = a; i <= b; ++i) cpus.push_back(i);
+    }
+    return cpus;
+}
+
+// ---- GPU devices ----
+
+std::vector<GpuDevice> detectGpus() {
+    std::vector<GpuDevice> gpus;
+    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU) continue;
+        GpuDevice g;
+        g.name        = ggml_backend_dev_name(dev);
+        g.description = ggml_backend_dev_description(dev);
+        ggml_backend_dev_memory(dev, &g.free_bytes, &g.total_bytes);
+        gpus.push_back(std::move(g));
+    }
+    return gpus;
+}
+
+bool parseGpuLayers(const std::string& s, int& out) {
+    if (s == "auto") { out = kGpuLayersAuto; return true; }
+    if (s == "all")  { out = kGpuLayersAll;  return true; }
+    try {
+        size_t end = 0;
+        const int n = std::stoi(s, &end);
+        if (end == s.size() && n >= kGpuLayersAuto) { out = n; return true; }
+    } catch (const std::exception&) {
+    }
+    return false;
+}
+
+std::vector<float> parseTensorSplit(const std::string& s) {
+    std::vector<float> split;
+    std::stringstream ss(s);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        try {
+            size_t end = 0;
+            const float v = std::stof(part, &end);
+            if (end != part.size() || !(v >= 0.0f)) return {};
+            split.push_back(v);
+        } catch (const std::exception&) {
+            return {};
+        }
+    }
+    if (split.size() > llama_max_devices()) return {};
+    return split;
+}
+
+CpuTopology detectTopology() {
+    CpuTopology t;
+    t.logical  = std::max(1u, std::thread::hardware_concurrency());
+    t.physical = t.logical;
+
+    // physical cores = distinct (physical id, core id) pairs
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    if (cpuinfo) {
+        std::set<std::pair<int, int>> cores;
+        std::string line;
+        int phys = 0;
+        while (std::getline(cpuinfo, line)) {
+            const size_t colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            const std::string key = line.substr(0, line.find_last_not_of(" \t", colon - 1) + 1);
+            if (key == "physical id") phys = std::atoi(line.c_str() + colon + 1);
+            else if (key == "core id") cores.insert({ phys, std::atoi(line.c_str() + colon + 1) });
+        }
+        if (!cores.empty()) t.physical = (int)cores.size();
+    }
+
+    if (DIR* d = opendir("/sys/devices/system/node")) {
+        int nodes = 0;
+        while (dirent* e = readdir(d))
+            if (std::string(e->d_name).rfind("node", 0) == 0 && std::isdigit((unsigned char)e->d_name[4])) ++nodes;
+        closedir(d);
+        if (nodes > 0) t.numa_nodes = nodes;
+    }
+    return t;
+}
+
+static ggml_threadpool* make_threadpool(const std::vector<int>& cpus, int n_threads) {
+    ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+    std::fill(std::begin(tpp.cpumask), std::end(tpp.cpumask), false);
+    for (int cpu : cpus) tpp.cpumask[cpu] = true;
+    tpp.strict_cpu = true;   // one worker per listed CPU, in order
+    return ggml_threadpool_new(&tpp);
+}
+
+// ---- Model ----
+
+// madvise(WILLNEED) starts readahead over the whole mapping; touching a byte
+// per page then waits for it, so the file is resident when llama maps it.
+static void prefetch_file(const std::string& path) {
+#ifdef _WIN32
+    (void)path;   // llama maps the file itself; no prefetch here
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat sb;
+    if (::fstat(fd, &sb) == 0 && sb.st_size > 0) {
+        const size_t len  = (size_t)sb.st_size;
+        void*        addr = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            ::madvise(addr, len, MADV_WILLNEED);
+            const size_t page = (size_t)::sysconf(_SC_PAGESIZE);
+            volatile unsigned char sink = 0;
+            for (size_t off = 0; off < len; off += page) sink ^= ((const unsigned char*)addr)[off];
+            (void)sink;
+            ::munmap(addr, len);
+        }
+    }
+    ::close(fd);
+#endif
+}
+
+std::shared_ptr<Model> Model::load(const std::string& path, const ModelParams& p) {
+    if (p.prefetch && p.use_mmap && !p.vocab_only) prefetch_file(path);
+    backend_acquire(p.numa);
+    std::shared_ptr<Model> m(new Model());   // ~Model releases the backend
+
+    // llama reads one share per device it could use
+    std::vector<float> split(llama_max_devices(), 0.0f);
+    std::copy_n(p.tensor_split.begin(), std::min(p.tensor_split.size(), split.size()), split.begin());
 
     llama_model_params mp = llama_model_default_params();
-    mp.n_gpu_layers = n_gpu_layers;   // 0 = CPU only
-    mp.use_mmap     = true;
-    mp.use_mlock    = false;
+    // llama offloads the top n layers; past n_layer the output head goes too
+    mp.n_gpu_layers = p.n_gpu_layers == kGpuLayersAll ? 999 : std::max(0, p.n_gpu_layers);
+    mp.split_mode   = (llama_split_mode)p.split_mode;
+    mp.main_gpu     = p.main_gpu;
+    mp.tensor_split = split.data();
+    mp.vocab_only   = p.vocab_only;
+    mp.use_mmap     = p.use_mmap;
+    mp.use_mlock    = p.use_mlock;
 
-    g_model = llama_load_model_from_file(model_path.c_str(), mp);
-    if (!g_model) {
-        std::cerr << "load model failed: " << model_path << "\n";
-        return false;
+    m->model_ = llama_load_model_from_file(path.c_str(), mp);
+    if (!m->model_) {
+        std::cerr << "load model failed: " << path << "\n";
+        return nullptr;
     }
+    m->vocab_ = llama_model_get_vocab(m->model_);
+    if (!m->vocab_) {
+        std::cerr << "get vocab failed\n";
+        return nullptr;
+    }
+
+    if (p.vocab_only) return m;
+
+    // Detokenization becomes a lookup + memcpy: every piece, back to back.
+    const int n_vocab = llama_n_vocab(m->vocab_);
+    m->piece_off_.resize((size_t)n_vocab + 1);
+    m->pieces_.reserve((size_t)n_vocab * 8);
+    for (int t = 0; t < n_vocab; ++t) {
+        m->piece_off_[t] = (uint32_t)m->pieces_.size();
+        append_piece(m->vocab_, t, m->pieces_);
+    }
+    m->piece_off_[n_vocab] = (uint32_t)m->pieces_.size();
+    m->pieces_.shrink_to_fit();
+    return m;
+}
+
+Model::~Model() {
+    if (model_) llama_free_model(model_);
+    backend_release();
+}
+
+int Model::countTokens(std::string_view text, bool add_special) const {
+    std::vector<llama_token> toks;
+    tokenize_into(vocab_, text, add_special, toks);
+    return (int)toks.size();
+}
+
+int Model::nCtxTrain() const { return llama_model_n_ctx_train(model_); }
+int Model::nLayer()    const { return llama_model_n_layer(model_); }
+
+bool Model::renderChat(std::string_view system, std::string_view user, std::string& out) const {
+    const char* tmpl = llama_model_chat_template(model_, /*name*/ nullptr);
+    if (!tmpl) return false;
+    const std::string sys(system), usr(user);   // llama wants NUL-terminated content
+    const llama_chat_message msgs[2] = { { "system", sys.c_str() }, { "user", usr.c_str() } };
+    out.resize(2 * (sys.size() + usr.size()) + 256);
+    int n = llama_chat_apply_template(tmpl, msgs, 2, /*add_ass*/ true, &out[0], (int32_t)out.size());
+    if (n > (int)out.size()) {
+        out.resize((size_t)n);
+        n = llama_chat_apply_template(tmpl, msgs, 2, /*add_ass*/ true, &out[0], (int32_t)out.size());
+    }
+    if (n < 0) { out.clear(); return false; }
+    out.resize((size_t)n);
+    return true;
+}
+
+static ggml_type ggml_kv_type(KvType t) {
+    switch (t) {
+        case KvType::Q8_0: return GGML_TYPE_Q8_0;
+        case KvType::Q4_0: return GGML_TYPE_Q4_0;
+        default:           return GGML_TYPE_F16;
+    }
+}
+
+// Bytes per element, block scales included (q8_0: 34 B / 32, q4_0: 18 B / 32).
+static double kv_type_bytes(KvType t) {
+    switch (t) {
+        case KvType::Q8_0: return 34.0 / 32.0;
+        case KvType::Q4_0: return 18.0 / 32.0;
+        default:           return 2.0;
+    }
+}
+
+size_t Model::kvBytesPerToken(KvType kv, bool flash_attn) const {
+    const int n_head   = std::max(1, llama_model_n_head(model_));
+    const int n_embd_k = llama_model_n_embd(model_) / n_head * llama_model_n_head_kv(model_);   // GQA width
+    const double per_layer = n_embd_k * (kv_type_bytes(kv) + kv_type_bytes(flash_attn ? kv : KvType::F16));
+    return (size_t)(per_layer * llama_model_n_layer(model_) + 0.5);
+}
+
+// ---- Context ----
+
+Context::Context() : st_(new ContextState()) {}
+Context::~Context() = default;
+
+llama_context* Context::raw() const { return st_->ctx; }
+
+// n_batch bounds the tokens per llama_decode call (0 = min(n_ctx, 512)); prompt
+// prefill is chunked to the resulting n_ubatch so activations stay bounded.
+std::unique_ptr<Context> Context::create(std::shared_ptr<Model> model, const ContextParams& p) {
+    if (!model) return nullptr;
+    std::unique_ptr<Context> self(new Context());
+    ContextState& c = *self->st_;
+    c.model = std::move(model);
+    c.vocab = c.model->vocab();
 
     llama_context_params cp = llama_context_default_params();
-    cp.n_ctx     = (n_ctx > 0 ? n_ctx : 2048);
-    cp.n_threads = 0; 
+    cp.n_ctx     = (p.n_ctx > 0 ? p.n_ctx : 2048);
+    const CpuTopology topo = detectTopology();
+    cp.n_threads       = p.n_threads       > 0 ? p.n_threads       : topo.physical;
+    cp.n_threads_batch = p.n_threads_batch > 0 ? p.n_threads_batch : topo.logical;
+    if (!p.cpus.empty()) {
+        // a pinned pool can't use more threads than it has CPUs
+        cp.n_threads       = std::min<int>(cp.n_threads,       (int)p.cpus.size());
+        cp.n_threads_batch = std::min<int>(cp.n_threads_batch, (int)p.cpus.size());
+    }
+    c.n_parallel = std::max(1, p.n_parallel);
+    cp.n_seq_max = (uint32_t)c.n_parallel + 1;   // + seq 0 for the shared prefix
+    cp.n_batch   = (uint32_t)(p.n_batch > 0 ? std::min<int>(p.n_batch, cp.n_ctx)
+                                            : std::min<int>(512, cp.n_ctx));
+    cp.n_ubatch  = std::min<uint32_t>(cp.n_ubatch, cp.n_batch);
+    cp.flash_attn = p.flash_attn;
+    cp.type_k     = ggml_kv_type(p.kv_type);
+    cp.type_v     = p.flash_attn ? ggml_kv_type(p.kv_type) : GGML_TYPE_F16;
 
-    g_ctx = llama_new_context_with_model(g_model, cp);
-    if (!g_ctx) {
+    c.ctx = llama_new_context_with_model(c.model->raw(), cp);
+    if (!c.ctx) {
         std::cerr << "new context failed\n";
+        return nullptr;
+    }
+
+    if (!p.cpus.empty()) {
+        c.tp       = make_threadpool(p.cpus, cp.n_threads);
+        c.tp_batch = make_threadpool(p.cpus, cp.n_threads_batch);
+        if (c.tp && c.tp_batch) llama_attach_threadpool(c.ctx, c.tp, c.tp_batch);
+        else std::cerr << "[lw] threadpool creation failed; running unpinned\n";
+    }
+
+    c.batch_cap     = (int)llama_n_batch(c.ctx);
+    c.prefill_chunk = std::max(1, (int)llama_n_ubatch(c.ctx));
+    c.batch         = llama_batch_init(c.batch_cap, /*embd*/0, /*n_seq_max*/1);
+
+    if (p.draft && p.n_draft > 0) {
+        const llama_vocab* dv = p.draft->vocab();
+        if (llama_n_vocab(dv) != llama_n_vocab(c.vocab) || llama_token_bos(dv) != llama_token_bos(c.vocab) ||
+            llama_token_eos(dv) != llama_token_eos(c.vocab)) {
+            std::cerr << "[lw] draft model vocab differs from the main model; not using it\n";
+        } else if ((c.dctx = llama_new_context_with_model(p.draft->raw(), cp)) == nullptr) {
+            std::cerr << "[lw] draft context failed; not using it\n";
+        } else {
+            if (c.tp && c.tp_batch) llama_attach_threadpool(c.dctx, c.tp, c.tp_batch);
+            c.draft_model = p.draft;
+            c.n_draft     = p.n_draft;
+            c.dbatch_cap  = (int)llama_n_batch(c.dctx);
+            c.dbatch      = llama_batch_init(c.dbatch_cap, /*embd*/0, /*n_seq_max*/1);
+        }
+    }
+    c.n_lookup = std::max(0, p.n_lookup);
+    return self;
+}
+
+SpecStats Context::specStats() const {
+    SpecStats s;
+    s.drafted  = st_->n_drafted.load(std::memory_order_relaxed);
+    s.accepted = st_->n_accepted.load(std::memory_order_relaxed);
+    return s;
+}
+
+bool Context::setPrefix(const std::string& prefix) {
+    ContextState& c = *st_;
+
+    c.prefix_text.clear();
+    c.prefix_resident = false;
+    c.prefix_toks = prefix_tokens(c, prefix);
+    if (c.prefix_toks.empty()) return false;
+
+    if (!prime_prefix(c)) {
+        std::cerr << "llama_decode(prefix) failed\n";
+        c.prefix_toks.clear();
         return false;
     }
+    c.prefix_text = prefix;
+    return true;
+}
 
-    g_vocab = llama_model_get_vocab(g_model);
-    if (!g_vocab) {
-        std::cerr << "get vocab failed\n";
+void Context::setSuffix(const std::string& suffix) {
+    ContextState& c = *st_;
+    c.suffix_toks.clear();
+    tokenize_into(c.vocab, suffix, /*add_special*/ false, c.suffix_toks);
+    c.suffix_text = c.suffix_toks.empty() ? std::string() : suffix;
+}
+
+bool Context::savePrefixState(const std::string& path) const {
+    const ContextState& c = *st_;
+    if (!c.prefix_resident) return false;
+    const size_t n = llama_state_seq_save_file(c.ctx, path.c_str(), 0, c.prefix_toks.data(), c.prefix_toks.size());
+    if (n == 0) std::cerr << "[lw] saving prefix state to " << path << " failed\n";
+    return n != 0;
+}
+
+bool Context::loadPrefixState(const std::string& path, const std::string& prefix) {
+    ContextState& c = *st_;
+    c.prefix_text.clear();
+    c.prefix_resident = false;
+    c.prefix_toks = prefix_tokens(c, prefix);
+    if (c.prefix_toks.empty()) return false;
+
+    std::vector<llama_token> saved(c.prefix_toks.size() + 1);
+    size_t n_saved = 0;
+    llama_kv_cache_seq_rm(c.ctx, 0, -1, -1);
+    const size_t n = llama_state_seq_load_file(c.ctx, path.c_str(), 0, saved.data(), saved.size(), &n_saved);
+    saved.resize(n_saved);
+    if (n == 0 || saved != c.prefix_toks) {
+        // missing, from another prompt/tokenizer, or a KV layout this context can't take
+        llama_kv_cache_seq_rm(c.ctx, 0, -1, -1);
+        c.prefix_toks.clear();
         return false;
     }
+    c.prefix_resident = true;
+    c.prefix_text     = prefix;
+    prime_draft_prefix(c);
     return true;
 }
 
-std::string generate(const std::string& prompt, int max_tokens /*=512*/) {
-    if (!g_ctx || !g_model || !g_vocab) throw std::runtime_error("llama not initialized");
-
-    // 1) tokenize (C API)
-    std::vector<llama_token> toks(prompt.size() + 8);
-    int n_tok = llama_tokenize(
-        g_vocab,
-        prompt.c_str(),
-        (int)prompt.size(),
-        toks.data(),
-        (int)toks.size(),
-        /*add_special*/ true,
-        /*parse_special*/ true
-    );
-    if (n_tok < 0) throw std::runtime_error("tokenize buffer too small");
-    toks.resize(n_tok);
-    const llama_token bos = llama_token_bos(g_vocab); 
-    if (bos != -1) {
-        toks.insert(toks.begin(), bos);
-    }
-
-    const int n_ctx_tokens = llama_n_ctx(g_ctx);
-    if ((int)toks.size() >= n_ctx_tokens)
-        throw std::runtime_error("prompt too long for context");
-
-    // 2) build batch & feed prompt 
-    llama_batch batch = llama_batch_init(std::max(n_ctx_tokens, 512), /*embd*/0, /*n_seq_max*/1);
-    batch.n_tokens = 0;
-    for (int i = 0; i < (int)toks.size(); ++i) {
-        int idx = batch.n_tokens++;
-        batch.token[idx]     = toks[i];
-        batch.pos[idx]       = i;
-        batch.n_seq_id[idx]  = 1;
-        batch.seq_id[idx][0] = 0;
-        batch.logits[idx]    = (i == (int)toks.size() - 1);
-    }
-    if (llama_decode(g_ctx, batch) != 0) {
-        llama_batch_free(batch);
-        throw std::runtime_error("llama_decode(prompt) failed");
-    }
-
-    // 3) generation loop (greedy)
-    std::ostringstream out;
-    const int n_vocab = llama_n_vocab(g_vocab);
-    int n_past = (int)toks.size();
-
-    for (int step = 0; step < max_tokens; ++step) {
-        const float* logits = llama_get_logits(g_ctx);
-        if (!logits) break;
-
-        int tok = argmax(logits, n_vocab);
-        if (tok == llama_token_eos(g_vocab)) break;
-
-        out << token_to_piece(tok);
+bool Context::setGrammar(const std::string& gbnf) {
+    ContextState& c = *st_;
+    if (c.grammar) { llama_sampler_free(c.grammar); c.grammar = nullptr; }
+    if (gbnf.empty()) return true;
+    c.grammar = llama_sampler_init_grammar(c.vocab, gbnf.c_str(), "root");
+    if (!c.grammar) {
+        std::cerr << "grammar parse failed\n";
+        return false;
+    }
+    return true;
+}
+
+// ---- Batched generation engine ----
+// Requests are assigned to slots; each slot owns one seq_id and position counter.
+// Every step builds a single llama_batch holding the next token of each decoding
+// slot plus up to one prefill chunk per joining slot, so N plans share one decode.
+
+struct Request {
+    const std::string* prompt = nullptr;
+    const GenParams*   gp     = nullptr;
+    const PieceFn*     on_piece = nullptr;
+    std::string        out;
+    size_t             n_emitted = 0;   // out[0, n_emitted) already streamed
+    std::string        chunk;           // reused for each streamed piece
+    bool               cancelled = false;
+    std::string        error;
+    Job*               job = nullptr;   // serve(): owner of prompt/gp/on_piece
+};
+
+static void slot_release(ContextState& c, Slot& slot) {
+    llama_kv_cache_seq_rm(c.ctx, slot.seq, -1, -1);
+    if (c.dctx) llama_kv_cache_seq_rm(c.dctx, slot.seq, -1, -1);
+    slot.d_pending.clear();
+    slot.drafts.clear();
+    slot.lookup.clear();
+    slot.n_spec = 0;
+    if (slot.grammar) { llama_sampler_free(slot.grammar); slot.grammar = nullptr; }
+    slot.req = -1;
+    slot.prompt.clear();
+    slot.i_batch  = -1;
+    slot.fork_src = -1;
+}
+
+// Tokenize a request into the slot; forks the cached prefix when the prompt starts with it.
+static bool slot_start(ContextState& c, Slot& slot, Request& r, int n_ctx_tokens) {
+    const std::string& prompt = *r.prompt;
+    llama_kv_cache_seq_rm(c.ctx, slot.seq, -1, -1);
+    slot.n_gen    = 0;
+    slot.i_batch  = -1;
+    slot.i_prompt = 0;
+    slot.json     = {};
+    slot.smp      = sampling::Sampler(r.gp->sampling);
+    slot.prompt.clear();   // keeps its capacity
+    // ~4 bytes per token; grows geometrically past that
+    r.out.reserve((size_t)std::min(std::max(r.gp->max_tokens, 0), 4096) * 4);
+
+    const bool use_prefix = c.prefix_resident &&
+                            prompt.compare(0, c.prefix_text.size(), c.prefix_text) == 0;
+    metrics::ScopedTimer tokenize_timer(metrics::Stage::Tokenize);
+    if (use_prefix) {
+        int n_keep = (int)c.prefix_toks.size();
+        std::string_view rest = std::string_view(prompt).substr(c.prefix_text.size());
+        const bool use_suffix = !c.suffix_text.empty() && rest.size() >= c.suffix_text.size() &&
+                                rest.compare(rest.size() - c.suffix_text.size(), c.suffix_text.size(),
+                                             c.suffix_text) == 0;
+        if (use_suffix) rest.remove_suffix(c.suffix_text.size());
+        tokenize_into(c.vocab, rest, /*add_special*/ false, slot.prompt);
+        if (use_suffix) slot.prompt.insert(slot.prompt.end(), c.suffix_toks.begin(), c.suffix_toks.end());
+        if (slot.prompt.empty()) {
+            // need at least one token in the batch to get logits back
+            slot.prompt.push_back(c.prefix_toks.back());
+            --n_keep;
+        }
+        llama_kv_cache_seq_cp(c.ctx, 0, slot.seq, 0, n_keep);
+        slot.n_past = n_keep;
+    } else {
+        tokenize_into(c.vocab, prompt, /*add_special*/ true, slot.prompt);
+        slot.n_past = 0;
+    }
+
+    const size_t n_before = slot.prompt.size();
+    if (!r.gp->forced_output.empty())
+        tokenize_into(c.vocab, r.gp->forced_output, /*add_special*/ false, slot.prompt);
+    const size_t n_forced = slot.prompt.size() - n_before;
+    slot.n_base   = slot.n_past;
+    slot.fork_src = -1;
+    if (slot.n_past + (int)slot.prompt.size() >= n_ctx_tokens) {
+        r.error = "prompt too long for context";
+        slot_release(c, slot);
+        return false;
+    }
+    if (c.grammar) slot.grammar = llama_sampler_clone(c.grammar);
+    if (n_forced > 0) {
+        const llama_token* forced = slot.prompt.data() + slot.prompt.size() - n_forced;
+        if (slot.grammar) {
+            try {
+                for (size_t i = 0; i < n_forced; ++i) llama_sampler_accept(slot.grammar, forced[i]);
+            } catch (const std::exception& e) {
+                std::cerr << "[lw] forced output rejected by the grammar (" << e.what() << "); decoding unconstrained\n";
+                llama_sampler_free(slot.grammar);
+                slot.grammar = nullptr;
+            }
+        }
+        for (size_t i = 0; i < n_forced; ++i) slot.smp.accept(forced[i]);
+        r.out.assign(r.gp->forced_output);
+        slot.json.feedUntilClosed(r.out);
+    }
+    if (c.n_draft > 0) {
+        llama_kv_cache_seq_rm(c.dctx, slot.seq, -1, -1);
+        if (slot.n_past > 0) llama_kv_cache_seq_cp(c.dctx, 0, slot.seq, 0, slot.n_past);
+        slot.d_past    = slot.n_past;
+        slot.d_pending = slot.prompt;   // caught up on the first speculation step
+    } else if (c.n_lookup > 0) {
+        slot.lookup.clear();
+        slot.lookup.toks.reserve(slot.n_past + slot.prompt.size() + r.gp->max_tokens);
+        slot.lookup.last.reserve(4 * (slot.n_past + slot.prompt.size()));
+        for (int i = 0; i < slot.n_past; ++i) slot.lookup.push(c.prefix_toks[i]);
+        for (llama_token t : slot.prompt)     slot.lookup.push(t);
+    }
+    return true;
+}
+
+// Shortest shared run worth waiting for; below this, decoding it is cheaper than
+// holding the slot back a step.
+constexpr size_t kMinFork = 16;
+
+// Prompts past the cached prefix often share more (same goal and fields, one
+// value different). In the unified KV cache a cell can belong to several
+// sequences, so llama_kv_cache_seq_cp of a decoded range costs no memory: point
+// the new slot at the live slot whose prompt agrees longest with its own, and
+// let it skip that part once the source has decoded it. Sources that are
+// themselves waiting are not used, so forks never chain.
+static void plan_fork(std::vector<Slot>& slots, int i) {
+    Slot&  dst  = slots[i];
+    size_t best = 0;
+    for (int j = 0; j < (int)slots.size(); ++j) {
+        const Slot& src = slots[j];
+        if (j == i || src.req < 0 || src.fork_src >= 0 || src.n_base != dst.n_base) continue;
+        // keep the last prompt token: the slot needs its logits
+        const size_t n = std::min(src.prompt.size(), dst.prompt.size() - 1);
+        size_t k = 0;
+        while (k < n && src.prompt[k] == dst.prompt[k]) ++k;
+        if (k > best) { best = k; dst.fork_src = j; }
+    }
+    if (best < kMinFork) { dst.fork_src = -1; return; }
+    dst.fork_req = slots[dst.fork_src].req;
+    dst.fork_len = best;
+}
+
+// Complete forks whose source has decoded far enough; drop those whose source
+// went away. Returns the number of prompt tokens shared this step.
+static int resolve_forks(ContextState& c, std::vector<Slot>& slots) {
+    int shared = 0;
+    for (Slot& dst : slots) {
+        if (dst.req < 0 || dst.fork_src < 0) continue;
+        const Slot& src = slots[dst.fork_src];
+        if (src.req != dst.fork_req) { dst.fork_src = -1; continue; }   // released or reused
+        if (src.i_prompt < dst.fork_len) continue;
+        llama_kv_cache_seq_cp(c.ctx, src.seq, dst.seq, dst.n_base, dst.n_base + (int)dst.fork_len);
+        dst.i_prompt = dst.fork_len;
+        dst.n_past   = dst.n_base + (int)dst.fork_len;
+        dst.fork_src = -1;
+        shared += (int)dst.fork_len;
+    }
+    return shared;
+}
+
+// Stop conditions evaluated on the text a token just appended (out[from, end)).
+// Cuts the output at the stop point; returns true when the sequence is done.
+static bool check_stop(Slot& slot, Request& r, size_t from) {
+    if (r.gp->stop_at_json_close) {
+        const size_t at = slot.json.feedUntilClosed(std::string_view(r.out).substr(from));
+        if (at != std::string_view::npos) {
+            r.out.resize(from + at);
+            return true;
+        }
+    }
+    for (const std::string& st : r.gp->stop) {
+        if (st.empty()) continue;
+        // a stop string may straddle the previous piece
+        const size_t scan = from >= st.size() - 1 ? from - (st.size() - 1) : 0;
+        const size_t at   = r.out.find(st, scan);
+        if (at != std::string::npos) {
+            r.out.resize(at);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Bytes at the end of s that form an incomplete UTF-8 sequence (0-3). A token's
+// piece can end mid-codepoint; the rest arrives with the next token.
+static size_t utf8_incomplete_tail(const std::string& s) {
+    const size_t n = s.size();
+    for (size_t k = 1; k <= 3 && k <= n; ++k) {
+        const unsigned char c = (unsigned char)s[n - k];
+        if ((c & 0xC0) == 0x80) continue;             // continuation byte, keep looking
+        const size_t len = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return len > k ? k : 0;
+    }
+    return 0;
+}
+
+// Push newly generated text to the stream callback. While the sequence is still
+// running, hold back a partial UTF-8 codepoint and any tail that could be the
+// start of a stop string. Returns false when the callback asked to stop.
+static bool emit_pending(Request& r, bool final) {
+    if (!r.on_piece || r.cancelled) return !r.cancelled;
+    size_t end = r.out.size();
+    if (!final) {
+        end -= utf8_incomplete_tail(r.out);
+        for (const std::string& st : r.gp->stop) {
+            for (size_t k = std::min(st.size() - (st.empty() ? 0 : 1), end - r.n_emitted); k > 0; --k) {
+                if (r.out.compare(end - k, k, st, 0, k) == 0) { end -= k; break; }
+            }
+        }
+    }
+    if (end <= r.n_emitted) return true;
+    r.chunk.assign(r.out, r.n_emitted, end - r.n_emitted);
+    r.n_emitted = end;
+    if (!(*r.on_piece)(r.chunk)) r.cancelled = true;
+    return !r.cancelled;
+}
+
+// Speculation, before each main decode: catch every decoding slot's draft KV
+// up with what the main model committed (plus `next`), then extend greedily,
+// one batched draft decode per draft position. The main batch then carries
+// next + drafts for each slot and verification keeps the longest prefix the
+// main model's own sampler agrees with, so output is unchanged by the draft.
+// Sets slot.n_spec for every decoding slot: at most k, within max_tokens and
+// n_ctx, and so that each slot's 1 + n_spec rows fit one main batch together.
+static bool spec_budget(ContextState& c, std::vector<Slot>& slots, const std::vector<Request>& reqs,
+                        int n_ctx_tokens, int k) {
+    int n_dec = 0;
+    for (Slot& slot : slots) {
+        slot.drafts.clear();
+        slot.n_spec = 0;
+        slot.d_row  = -1;
+        if (slot.req >= 0 && !slot.prefilling()) ++n_dec;
+    }
+    if (n_dec == 0) return false;
+    const int per_slot = std::min(k, c.batch_cap / n_dec - 1);
+    if (per_slot <= 0) return false;
+
+    for (Slot& slot : slots) {
+        if (slot.req < 0 || slot.prefilling()) continue;
+        const GenParams& gp = *reqs[slot.req].gp;
+        slot.n_spec = std::max(0, std::min({ per_slot, gp.max_tokens - slot.n_gen - 1,
+                                             n_ctx_tokens - slot.n_past - 2 }));
+    }
+    return true;
+}
+
+// Model-free drafts: continue the latest earlier occurrence of each slot's tail.
+static void speculate_lookup(ContextState& c, std::vector<Slot>& slots, const std::vector<Request>& reqs,
+                             int n_ctx_tokens) {
+    if (!spec_budget(c, slots, reqs, n_ctx_tokens, c.n_lookup)) return;
+    for (Slot& slot : slots)
+        if (slot.n_spec > 0) slot.lookup.draft(slot.n_spec, slot.drafts);
+}
+
+static void speculate(ContextState& c, std::vector<Slot>& slots, const std::vector<Request>& reqs,
+                      int n_ctx_tokens, int n_vocab) {
+    if (!spec_budget(c, slots, reqs, n_ctx_tokens, c.n_draft)) return;
+    for (Slot& slot : slots)
+        if (slot.n_spec > 0) slot.d_pending.push_back(slot.next);
+
+    // catch up, chunked to the draft batch; logits only after each slot's last token
+    for (;;) {
+        c.dbatch.n_tokens = 0;
+        for (Slot& slot : slots) {
+            if (slot.n_spec == 0 || slot.d_pending.empty()) continue;
+            const size_t room = (size_t)(c.dbatch_cap - c.dbatch.n_tokens);
+            const size_t n    = std::min(slot.d_pending.size(), room);
+            for (size_t j = 0; j < n; ++j) {
+                const bool last = j + 1 == slot.d_pending.size();
+                const int  idx  = batch_add(c.dbatch, slot.d_pending[j], slot.d_past++, slot.seq, last);
+                if (last) slot.d_row = idx;
+            }
+            slot.d_pending.erase(slot.d_pending.begin(), slot.d_pending.begin() + (long)n);
+        }
+        if (c.dbatch.n_tokens == 0) break;
+        if (llama_decode(c.dctx, c.dbatch) != 0) { drop_draft(c, "draft decode failed"); break; }
+    }
+
+    // greedy extension
+    while (c.n_draft > 0) {
+        c.dbatch.n_tokens = 0;
+        for (Slot& slot : slots) {
+            if (slot.n_spec == 0 || slot.d_row < 0) continue;
+            const float* logits = llama_get_logits_ith(c.dctx, slot.d_row);
+            slot.d_row = -1;
+            if (!logits) continue;
+            const llama_token tok = sampling::argmax(logits, n_vocab);
+            slot.drafts.push_back(tok);
+            if ((int)slot.drafts.size() < slot.n_spec)
+                slot.d_row = batch_add(c.dbatch, tok, slot.d_past++, slot.seq, true);
+        }
+        if (c.dbatch.n_tokens == 0) break;
+        if (llama_decode(c.dctx, c.dbatch) != 0) { drop_draft(c, "draft decode failed"); break; }
+    }
+    if (c.n_draft == 0) for (Slot& slot : slots) slot.drafts.clear();
+}
+
+// After verification: the main model committed next + drafts[0, accepted).
+// Roll the draft KV back to what it saw of that and queue the rest.
+static void settle_draft(ContextState& c, Slot& slot, int n_prev, llama_token fed, int accepted) {
+    if (slot.n_spec == 0) { slot.d_pending.push_back(fed); return; }
+    if (c.n_draft == 0) return;
+    // drafts[0, size-1) were decoded in the draft context, the last one was not
+    const int in_draft = std::min<int>(accepted, std::max<int>(0, (int)slot.drafts.size() - 1));
+    slot.d_past = n_prev + 1 + in_draft;
+    llama_kv_cache_seq_rm(c.dctx, slot.seq, slot.d_past, -1);
+    slot.d_pending.assign(slot.drafts.begin() + in_draft, slot.drafts.begin() + accepted);
+}
+
+static const char* stop_reason(const GenParams& gp, std::chrono::steady_clock::time_point now) {
+    if (gp.cancel && gp.cancel->load(std::memory_order_relaxed)) return "cancelled";
+    if (gp.deadline != std::chrono::steady_clock::time_point{} && now >= gp.deadline) return "deadline exceeded";
+    return nullptr;
+}
+
+// KV admission for serve(): cells still uncommitted after every live sequence
+// gets the rest of its prompt and of its output reservation. The reservation
+// is capped at a fair share of n_ctx; sequences that outgrow it fall back on
+// the kv-full handling in run_engine.
+static int kv_headroom(const ContextState& c, const std::vector<Slot>& slots, const std::vector<Request>& reqs,
+                       int n_ctx_tokens) {
+    const int share = n_ctx_tokens / c.n_parallel;
+    int committed   = std::max(0, llama_get_kv_cache_used_cells(c.ctx));
+    for (const Slot& slot : slots) {
+        if (slot.req < 0) continue;
+        committed += (int)(slot.prompt.size() - slot.i_prompt);
+        committed += std::max(0, std::min(reqs[slot.req].gp->max_tokens, share) - slot.n_gen);
+    }
+    return n_ctx_tokens - committed;
+}
+
+// With src set (serve), reqs start empty and fill from src as slots free up;
+// finished entries are handed back to src and reused.
+static void run_steps(ContextState& c, std::vector<Request>& reqs, JobSource* src) {
+
+    const int n_ctx_tokens = llama_n_ctx(c.ctx);
+
+    bool any_prefixed = src && !c.prefix_text.empty();
+    for (const Request& r : reqs)
+        any_prefixed |= !c.prefix_text.empty() &&
+                        r.prompt->compare(0, c.prefix_text.size(), c.prefix_text) == 0;
+    if (any_prefixed && !c.prefix_resident && !prime_prefix(c))
+        std::cerr << "llama_decode(prefix) failed; decoding full prompts\n";
+
+    // Every run ends (or unwinds, see run_engine) with all slots released.
+    std::vector<Slot>& slots = c.slots;
+    slots.resize(c.n_parallel);
+    for (int i = 0; i < c.n_parallel; ++i) slots[i].seq = i + 1;
 
+    std::deque<int> queue;
+    for (int i = 0; i < (int)reqs.size(); ++i) queue.push_back(i);
+
+    llama_batch& batch   = c.batch;
+    const int  n_vocab   = llama_n_vocab(c.vocab);
+    const auto eos       = llama_token_eos(c.vocab);
+    bool       kv_full   = false;   // stop admitting until a slot frees cells
+
+    std::vector<int> free_reqs;      // serve(): reqs entries to reuse
+    auto complete = [&](int ri) {
+        if (!src) return;
+        Request& r = reqs[ri];
+        if (!r.error.empty()) metrics::add(metrics::Counter::Errors);
+        src->finished(r.job, std::move(r.out), std::move(r.error));
+        r = Request();
+        free_reqs.push_back(ri);
+    };
+
+    for (;;) {
+        // 0) drop cancelled and expired requests
+        const auto now = std::chrono::steady_clock::now();
+        for (Slot& slot : slots) {
+            if (slot.req < 0) continue;
+            const int ri = slot.req;
+            const char* why = stop_reason(*reqs[ri].gp, now);
+            if (!why) continue;
+            reqs[ri].error = why;
+            slot_release(c, slot);
+            complete(ri);
+            kv_full = false;
+        }
+
+        // 1) admit queued requests into free slots (serve: pull from src while
+        //    the KV headroom allows)
+        for (Slot& slot : slots) {
+            if (kv_full) break;
+            if (slot.req >= 0) continue;
+            int ri = -1;
+            if (!queue.empty()) {
+                ri = queue.front(); queue.pop_front();
+            } else if (src) {
+                int n_free = 0;
+                for (const Slot& s : slots) n_free += s.req < 0;
+                Job* job = src->next(kv_headroom(c, slots, reqs, n_ctx_tokens), n_free,
+                                     n_free == (int)slots.size());
+                if (!job) break;
+                if (free_reqs.empty()) { free_reqs.push_back((int)reqs.size()); reqs.emplace_back(); }
+                ri = free_reqs.back(); free_reqs.pop_back();
+                Request& r = reqs[ri];
+                r.prompt   = &job->prompt;
+                r.gp       = &job->gp;
+                r.on_piece = job->on_piece ? &job->on_piece : nullptr;
+                r.job      = job;
+            } else {
+                break;
+            }
+            if (const char* why = stop_reason(*reqs[ri].gp, now)) {
+                reqs[ri].error = why;
+                complete(ri);
+                continue;
+            }
+            if (slot_start(c, slot, reqs[ri], n_ctx_tokens)) {
+                slot.req = ri;
+                plan_fork(slots, (int)(&slot - slots.data()));
+            } else {
+                complete(ri);
+            }
+        }
+        if (const int shared = resolve_forks(c, slots)) metrics::add(metrics::Counter::SharedTokens, shared);
+
+        // 2) one batch: next token (+ drafts) of every decoding slot, then prefill
+        //    chunks of joining slots until n_batch is used up
+        const auto t_step = std::chrono::steady_clock::now();
+        if (c.n_draft > 0)       speculate(c, slots, reqs, n_ctx_tokens, n_vocab);
+        else if (c.n_lookup > 0) speculate_lookup(c, slots, reqs, n_ctx_tokens);
         batch.n_tokens = 0;
-        int idx = batch.n_tokens++;
-        batch.token[idx]     = tok;
-        batch.pos[idx]       = n_past;
-        batch.n_seq_id[idx]  = 1;
-        batch.seq_id[idx][0] = 0;
-        batch.logits[idx]    = 1; 
+        for (Slot& slot : slots) {
+            slot.i_batch = -1;
+            slot.n_feed  = 0;
+            if (slot.req < 0 || slot.prefilling() || batch.n_tokens >= c.batch_cap) continue;
+            slot.i_batch = batch_add(batch, slot.next, slot.n_past, slot.seq, true);
+            for (size_t j = 0; j < slot.drafts.size(); ++j)
+                batch_add(batch, slot.drafts[j], slot.n_past + 1 + (int)j, slot.seq, true);
+            slot.n_feed  = 1 + (int)slot.drafts.size();
+        }
+        for (Slot& slot : slots) {
+            if (slot.req < 0 || !slot.prefilling() || slot.fork_src >= 0) continue;
+            const size_t room = (size_t)(c.batch_cap - batch.n_tokens);
+            const size_t n    = std::min({ slot.prompt.size() - slot.i_prompt,
+                                           (size_t)c.prefill_chunk, room });
+            for (size_t j = 0; j < n; ++j) {
+                const size_t i    = slot.i_prompt + j;
+                const bool   last = i + 1 == slot.prompt.size();
+                const int    idx  = batch_add(batch, slot.prompt[i], slot.n_past + (int)j, slot.seq, last);
+                if (last) slot.i_batch = idx;
+            }
+            slot.n_feed = (int)n;
+        }
+        if (batch.n_tokens == 0) {
+            if (queue.empty()) break;
+            kv_full = false;
+            continue;
+        }
+
+        int n_prefill = 0;
+        for (const Slot& slot : slots) if (slot.req >= 0 && slot.prefilling()) n_prefill += slot.n_feed;
+        const auto t_dec = std::chrono::steady_clock::now();
+        const int rc = llama_decode(c.ctx, batch);
+        const auto t_dec_end = std::chrono::steady_clock::now();
+        if (rc == 1) {
+            // no KV slot for this batch: push the newest prefilling request back,
+            // or truncate the longest sequence if nothing else can give way
+            int n_active = 0;
+            Slot* victim = nullptr;
+            for (Slot& slot : slots) {
+                if (slot.req < 0) continue;
+                ++n_active;
+                if (slot.prefilling() && slot.n_feed > 0) victim = &slot;
+            }
+            if (victim && n_active > 1) {
+                queue.push_front(victim->req);
+            } else {
+                for (Slot& slot : slots)
+                    if (slot.req >= 0 && (!victim || slot.n_past > victim->n_past)) victim = &slot;
+                if (!victim) break;
+                if (victim->prefilling()) reqs[victim->req].error = "kv cache full";
+                else {
+                    std::cerr << "[lw] kv cache full, truncating request " << victim->req << "\n";
+                    metrics::add(metrics::Counter::Truncated);
+                }
+                emit_pending(reqs[victim->req], /*final*/ true);
+                const int ri = victim->req;
+                slot_release(c, *victim);
+                complete(ri);
+                victim = nullptr;
+            }
+            if (victim) slot_release(c, *victim);
+            // drop whatever part of the failed batch made it into the cache; the
+            // draft context forgets this step's drafts (next is re-proposed)
+            for (Slot& slot : slots) {
+                if (slot.req < 0) continue;
+                llama_kv_cache_seq_rm(c.ctx, slot.seq, slot.n_past, -1);
+                if (slot.n_spec > 0 && c.n_draft > 0) {
+                    llama_kv_cache_seq_rm(c.dctx, slot.seq, slot.n_past, -1);
+                    slot.d_past = slot.n_past;
+                    slot.d_pending.clear();
+                }
+                slot.drafts.clear();
+                slot.n_spec = 0;
+            }
+            kv_full = true;
+            continue;
+        }
+        if (rc != 0) {
+            for (Slot& slot : slots) {
+                if (slot.req < 0) continue;
+                const int ri = slot.req;
+                reqs[ri].error = "llama_decode failed";
+                slot_release(c, slot);
+                complete(ri);
+            }
+            for (int ri : queue) { reqs[ri].error = "llama_decode failed"; complete(ri); }
+            throw std::runtime_error("llama_decode failed");
+        }
+
+        int n_committed = 0;
+
+        // 3) advance positions, sample (grammar-masked if set) where logits came
+        //    back, retire finished. A decoding slot gets one row for `next` plus
+        //    one per draft; each row is sampled as usual and the walk continues
+        //    while the pick equals the draft already sitting in the KV after it.
+        for (Slot& slot : slots) {
+            if (slot.req < 0 || slot.n_feed == 0) continue;
+            const bool prefill = slot.prefilling();
+            const int  n_prev  = slot.n_past;
+            const int  n_rows  = prefill ? 1 : slot.n_feed;
+            slot.n_past += prefill ? slot.n_feed : 1;
+            if (prefill) slot.i_prompt += slot.n_feed;
+            if (slot.i_batch < 0) continue;   // mid-prompt chunk, nothing to sample yet
+
+            Request& r = reqs[slot.req];
+            const llama_token fed = slot.next;
+            int  accepted = 0;
+            bool retired  = false;
+            for (int row = 0; row < n_rows; ++row) {
+                const float* logits = llama_get_logits_ith(c.ctx, slot.i_batch + row);
+                int tok = eos;
+                if (logits) tok = sample_token(c, slot.smp, slot.grammar, logits, n_vocab);
+                const bool ctx_full = slot.n_past >= n_ctx_tokens - 1;
+                if (tok < 0 || tok == eos || slot.n_gen >= r.gp->max_tokens || ctx_full) {
+                    if (ctx_full && tok >= 0 && tok != eos) {
+                        // not the model's choice: the plan is cut off mid-way
+                        metrics::add(metrics::Counter::Truncated);
+                        std::cerr << "[lw] request " << slot.req << " hit n_ctx=" << n_ctx_tokens << " after "
+                                  << slot.n_gen << " tokens; output truncated\n";
+                    }
+                    emit_pending(r, /*final*/ true);
+                    retired = true;
+                    break;
+                }
+                if (slot.grammar) llama_sampler_accept(slot.grammar, tok);
+                slot.smp.accept(tok);
+                const size_t before = r.out.size();
+                r.out.append(c.model->piece(tok));
+                slot.next = tok;
+                ++slot.n_gen;
+                ++n_committed;
+                if (c.n_lookup > 0 && c.n_draft == 0) slot.lookup.push(tok);
+                const bool done = check_stop(slot, r, before);
+                const bool keep = emit_pending(r, /*final*/ done);
+                if (done || !keep) { retired = true; break; }
+                if (row + 1 < n_rows && tok == slot.drafts[row]) { ++accepted; ++slot.n_past; continue; }
+                break;
+            }
+            if (retired) {
+                const int ri = slot.req;
+                slot_release(c, slot);
+                complete(ri);
+                kv_full = false;
+                continue;
+            }
+            if (prefill) continue;
+            if (n_rows > 1) {
+                llama_kv_cache_seq_rm(c.ctx, slot.seq, slot.n_past, -1);   // rejected drafts
+                c.n_drafted.fetch_add(slot.drafts.size(), std::memory_order_relaxed);
+                c.n_accepted.fetch_add((uint64_t)accepted, std::memory_order_relaxed);
+            }
+            if (c.n_draft > 0) settle_draft(c, slot, n_prev, fed, accepted);
+        }
 
-        if (llama_decode(g_ctx, batch) != 0) {
-            llama_batch_free(batch);
-            throw std::runtime_error("llama_decode(gen) failed");
+        // Prefill gets its token share of the llama_decode; the rest of the step
+        // (drafting, decode, sampling) is generation time.
+        const auto  ns = [](auto d) { return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(); };
+        const uint64_t prefill_ns = n_prefill ? ns(t_dec_end - t_dec) * (uint64_t)n_prefill / (uint64_t)batch.n_tokens : 0;
+        if (n_prefill) {
+            metrics::record(metrics::Stage::Prefill, prefill_ns, (uint64_t)n_prefill);
+            metrics::add(metrics::Counter::PromptTokens, (uint64_t)n_prefill);
         }
-        ++n_past;
-        if (n_past >= n_ctx_tokens - 1) break;
+        if (n_committed) {
+            metrics::record(metrics::Stage::Decode, ns(std::chrono::steady_clock::now() - t_step) - prefill_ns,
+                            (uint64_t)n_committed);
+            metrics::add(metrics::Counter::GenTokens, (uint64_t)n_committed);
+        }
+        metrics::kvUsage((uint32_t)std::max(0, llama_get_kv_cache_used_cells(c.ctx)), (uint32_t)n_ctx_tokens);
     }
+}
+
+// Tokenize, std::function callbacks and allocation can throw mid-run. Leave
+// the context reusable: free the slots' grammar clones and KV sequences, and
+// fail the serve() jobs still in flight, then rethrow.
+static void abort_engine(ContextState& c, std::vector<Request>& reqs, JobSource* src, const char* why) {
+    for (Slot& slot : c.slots) slot_release(c, slot);
+    if (!src) return;
+    for (Request& r : reqs) {
+        if (!r.job) continue;
+        Job* job = r.job;
+        r = Request();
+        src->finished(job, {}, why);
+    }
+}
+
+static void run_engine(ContextState& c, std::vector<Request>& reqs, JobSource* src = nullptr) {
+    try {
+        run_steps(c, reqs, src);
+    } catch (const std::exception& e) {
+        abort_engine(c, reqs, src, e.what());
+        throw;
+    } catch (...) {
+        abort_engine(c, reqs, src, "decode engine failed");
+        throw;
+    }
+}
+
+std::vector<std::string> Context::generateBatch(const std::vector<std::string>& prompts, const GenParams& gp) {
+    std::vector<Request> reqs(prompts.size());
+    for (size_t i = 0; i < prompts.size(); ++i) {
+        reqs[i].prompt = &prompts[i];
+        reqs[i].gp     = &gp;
+    }
+    run_engine(*st_, reqs);
+
+    std::vector<std::string> outs(reqs.size());
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        if (!reqs[i].error.empty()) {
+            std::cerr << "[lw] request " << i << ": " << reqs[i].error << "\n";
+            metrics::add(metrics::Counter::Errors);
+        }
+        outs[i] = std::move(reqs[i].out);
+    }
+    return outs;
+}
+
+void Context::serve(JobSource& src) {
+    std::vector<Request> reqs;
+    run_engine(*st_, reqs, &src);
+}
+
+std::string Context::generate(const std::string& prompt, const GenParams& gp, const PieceFn& on_piece) {
+    std::vector<Request> reqs(1);
+    reqs[0].prompt   = &prompt;
+    reqs[0].gp       = &gp;
+    reqs[0].on_piece = on_piece ? &on_piece : nullptr;
+    run_engine(*st_, reqs);
+    if (!reqs[0].error.empty()) {
+        metrics::add(metrics::Counter::Errors);
+        throw std::runtime_error(reqs[0].error);
+    }
+    return std::move(reqs[0].out);
+}
+
+// ---- ContextPool ----
+
+std::unique_ptr<ContextPool> ContextPool::create(std::shared_ptr<Model> model, const ContextParams& cp,
+                                                 int n_contexts) {
+    if (!model) return nullptr;
+    std::unique_ptr<ContextPool> pool(new ContextPool());
+    pool->model_ = model;
+    n_contexts = std::max(1, n_contexts);
+
+    // Contexts run concurrently, so give each its share of the cores instead of
+    // letting every one spin up a full-width thread pool.
+    const CpuTopology topo = detectTopology();
+    ContextParams each = cp;
+    if (each.n_threads <= 0)       each.n_threads       = std::max(1, topo.physical / n_contexts);
+    if (each.n_threads_batch <= 0) each.n_threads_batch = std::max(1, topo.logical / n_contexts);
+
+    for (int i = 0; i < n_contexts; ++i) {
+        if (!cp.cpus.empty()) {
+            const size_t per = std::max<size_t>(1, cp.cpus.size() / n_contexts);
+            const size_t b   = std::min(cp.cpus.size() - 1, i * per);
+            const size_t e   = (i + 1 == n_contexts) ? cp.cpus.size() : std::min(cp.cpus.size(), b + per);
+            each.cpus.assign(cp.cpus.begin() + b, cp.cpus.begin() + e);
+        }
+        std::unique_ptr<Context> ctx = Context::create(model, each);
+        if (!ctx) return nullptr;
+        pool->free_.push_back(ctx.get());
+        pool->all_.push_back(std::move(ctx));
+    }
+    return pool;
+}
+
+ContextPool::Lease ContextPool::acquire() {
+    std::unique_lock<std::mutex> lk(mu_);
+    cv_.wait(lk, [&] { return !free_.empty(); });
+    Context* ctx = free_.back();
+    free_.pop_back();
+    return Lease(this, ctx);
+}
+
+void ContextPool::release(Context* ctx) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        free_.push_back(ctx);
+    }
+    cv_.notify_one();
+}
+
+ContextPool::Lease::~Lease() {
+    if (pool_ && ctx_) pool_->release(ctx_);
+}
+
+bool ContextPool::setPrefix(const std::string& prefix) {
+    std::vector<Lease> held;
+    bool ok = true;
+    for (size_t i = 0; i < all_.size(); ++i) {
+        held.push_back(acquire());
+        ok &= held.back()->setPrefix(prefix);
+    }
+    return ok;
+}
+
+void ContextPool::setSuffix(const std::string& suffix) {
+    std::vector<Lease> held;
+    for (size_t i = 0; i < all_.size(); ++i) {
+        held.push_back(acquire());
+        held.back()->setSuffix(suffix);
+    }
+}
+
+bool ContextPool::savePrefixState(const std::string& path) {
+    Lease ctx = acquire();
+    return ctx->savePrefixState(path);
+}
+
+bool ContextPool::loadPrefixState(const std::string& path, const std::string& prefix) {
+    std::vector<Lease> held;
+    bool ok = true;
+    for (size_t i = 0; i < all_.size(); ++i) {
+        held.push_back(acquire());
+        ok &= held.back()->loadPrefixState(path, prefix);
+    }
+    return ok;
+}
+
+bool ContextPool::setGrammar(const std::string& gbnf) {
+    std::vector<Lease> held;
+    bool ok = true;
+    for (size_t i = 0; i < all_.size(); ++i) {
+        held.push_back(acquire());
+        ok &= held.back()->setGrammar(gbnf);
+    }
+    return ok;
+}
+
+SpecStats ContextPool::specStats() const {
+    SpecStats sum;
+    for (const std::unique_ptr<Context>& ctx : all_) {
+        const SpecStats s = ctx->specStats();
+        sum.drafted  += s.drafted;
+        sum.accepted += s.accepted;
+    }
+    return sum;
+}
 
-    llama_batch_free(batch);
-    return out.str();
+std::string ContextPool::generate(const std::string& prompt, const GenParams& gp, const PieceFn& on_piece) {
+    Lease ctx = acquire();
+    return ctx->generate(prompt, gp, on_piece);
 }
 
-void shutdown() {
-    if (g_ctx)   { llama_free(g_ctx);   g_ctx   = nullptr; }
-    if (g_model) { llama_free_model(g_model); g_model = nullptr; }
-    g_vocab = nullptr;
-    llama_backend_free();
+std::vector<std::string> ContextPool::generateBatch(const std::vector<std::string>& prompts, const GenParams& gp) {
+    Lease ctx = acquire();
+    return ctx->generateBatch(prompts, gp);
 }
 
 } // namespace lw
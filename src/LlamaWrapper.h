@@ -0,0 +1,287 @@
+// LlamaWrapper.h
+// Thin llama.cpp wrapper: shared model, pooled contexts, prefix cache, batched generation.
+
+#pragma once
+
+#include "Sampler.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct llama_model;
+struct llama_vocab;
+struct llama_context;
+
+namespace lw {
+
+// Per-request generation settings.
+struct GenParams {
+    int                      max_tokens = 512;
+    bool                     stop_at_json_close = true;   // end once the root {...} balances
+    std::vector<std::string> stop;                        // extra stop strings (not emitted)
+    sampling::Params         sampling;                    // default: greedy
+    // Start of the answer, decoded with the prompt instead of sampled; it heads
+    // the output (and the stream) as if generated, and advances the grammar.
+    std::string              forced_output;
+    // Checked between decode steps; either ends the request with an error.
+    const std::atomic<bool>*              cancel = nullptr;
+    std::chrono::steady_clock::time_point deadline{};     // default: none
+};
+
+// Streaming sink: receives decoded text in order, always cut on UTF-8 codepoint
+// boundaries and never containing a stop string. Return false to stop early.
+using PieceFn = std::function<bool(const std::string& piece)>;
+
+// A request handed to Context::serve by a JobSource. The engine reads prompt,
+// gp and on_piece until it passes the job back through JobSource::finished.
+struct Job {
+    std::string prompt;
+    GenParams   gp;
+    PieceFn     on_piece;
+    int         kv_need = 0;   // KV cells to have free before admitting (prompt past the prefix + output)
+};
+
+// Feeds Context::serve; both calls come from the serving thread.
+class JobSource {
+public:
+    virtual ~JobSource() = default;
+    // Next job to start, or nullptr. kv_free = cells not yet committed to live
+    // sequences, free_slots counts the one being filled; idle = nothing is
+    // running, so the job at the front should be taken.
+    virtual Job* next(int kv_free, int free_slots, bool idle) = 0;
+    // Exactly once per job taken; error is empty on success.
+    virtual void finished(Job* job, std::string text, std::string error) = 0;
+};
+
+// Mirrors ggml_numa_strategy. Process-wide; applied when the first model loads.
+enum class Numa { Disabled = 0, Distribute = 1, Isolate = 2, Numactl = 3, Mirror = 4 };
+
+// ModelParams::n_gpu_layers: every layer and the output head, or as many as
+// fit (core resolves that before loading; lw itself treats it as 0).
+constexpr int kGpuLayersAll  = -1;
+constexpr int kGpuLayersAuto = -2;
+
+// Mirrors llama_split_mode: how offloaded layers spread over several GPUs.
+// Layer = whole layers per GPU; Row = each tensor split by rows (tensor
+// parallel, needs fast links); None = main_gpu only.
+enum class SplitMode { None = 0, Layer = 1, Row = 2 };
+
+struct ModelParams {
+    int                n_gpu_layers = 0;      // 0 = CPU only
+    SplitMode          split_mode   = SplitMode::Layer;
+    int                main_gpu     = 0;      // None: the GPU used; Row: holds intermediate results
+    std::vector<float> tensor_split;          // share per GPU, e.g. {3, 1}; empty = by free memory
+    bool               use_mmap     = true;
+    bool               use_mlock    = false;  // lock weights in RAM (no paging under memory pressure)
+    bool               prefetch     = false;  // read the file into the page cache first, so the mapped
+                                              // weights take no major faults on the first decodes
+    bool               vocab_only   = false;  // hyperparameters + vocab, no weights (sizing probes)
+    Numa               numa         = Numa::Disabled;
+};
+
+class Model;
+
+// KV cache element type. llama.cpp only takes a quantized V cache together
+// with flash attention; without it V stays f16 and only K is quantized.
+enum class KvType { F16, Q8_0, Q4_0 };
+
+struct ContextParams {
+    int              n_ctx           = 2048;
+    int              n_parallel      = 1;   // decode slots; they use seq ids 1..n, seq 0 holds the prefix
+    int              n_batch         = 0;   // max tokens per llama_decode; 0 = min(n_ctx, 512)
+    int              n_threads       = 0;   // token generation; 0 = physical cores
+    int              n_threads_batch = 0;   // prompt prefill;   0 = logical cores
+    std::vector<int> cpus;                  // pin worker threads to these CPUs; empty = OS scheduling
+    KvType           kv_type         = KvType::F16;
+    bool             flash_attn      = false;
+
+    // Speculative decoding: a small model with the same vocab proposes up to
+    // n_draft tokens per step, the main model verifies them in the same batch.
+    std::shared_ptr<Model> draft;
+    int                    n_draft = 8;
+    // Model-free alternative: draft up to n_lookup tokens by matching the last
+    // few tokens against the prompt and output so far. Used when no draft model is set.
+    int                    n_lookup = 0;
+};
+
+// Draft tokens proposed / kept by the main model (draft model or n-gram lookup).
+struct SpecStats {
+    uint64_t drafted  = 0;
+    uint64_t accepted = 0;
+
+    double acceptance() const { return drafted ? (double)accepted / (double)drafted : 0.0; }
+};
+
+struct CpuTopology {
+    int logical    = 1;
+    int physical   = 1;
+    int numa_nodes = 1;
+};
+
+// Best effort: /proc and /sys on Linux, hardware_concurrency elsewhere.
+CpuTopology detectTopology();
+
+// "0-7,16,18-19" -> {0..7, 16, 18, 19}; empty on a parse error.
+std::vector<int> parseCpuList(const std::string& list);
+
+struct GpuDevice {
+    std::string name;          // backend device, e.g. "CUDA0"
+    std::string description;
+    size_t      free_bytes  = 0;
+    size_t      total_bytes = 0;
+};
+
+// GPU devices of the loaded ggml backends, in llama's device order (the
+// indices of main_gpu / tensor_split). Empty on a CPU-only build.
+std::vector<GpuDevice> detectGpus();
+
+// "auto" / "all" / a layer count (-1 and -2 as above); false on anything else.
+bool parseGpuLayers(const std::string& s, int& out);
+// "3,1" -> {3, 1}; empty on a parse error.
+std::vector<float> parseTensorSplit(const std::string& s);
+
+// GGUF weights + vocab. Read-only after load and shared by every context made
+// from it; freed when the last shared_ptr goes away.
+class Model {
+public:
+    static std::shared_ptr<Model> load(const std::string& path, const ModelParams& mp = {});
+    ~Model();
+
+    Model(const Model&)            = delete;
+    Model& operator=(const Model&) = delete;
+
+    llama_model*       raw()   const { return model_; }
+    const llama_vocab* vocab() const { return vocab_; }
+
+    int    countTokens(std::string_view text, bool add_special) const;
+    int    nCtxTrain() const;
+    int    nLayer() const;
+    // K + V bytes one cached token takes across all layers.
+    size_t kvBytesPerToken(KvType kv, bool flash_attn) const;
+    // The GGUF's chat template (tokenizer.chat_template) applied to one system
+    // and one user message, ending in the assistant header. false if the model
+    // has no template or llama.cpp doesn't recognise it.
+    bool renderChat(std::string_view system, std::string_view user, std::string& out) const;
+
+    // Text of a token (special tokens rendered), from the table built at load.
+    std::string_view piece(int tok) const {
+        if (tok < 0 || (size_t)tok + 1 >= piece_off_.size()) return {};
+        return std::string_view(pieces_.data() + piece_off_[tok], piece_off_[tok + 1] - piece_off_[tok]);
+    }
+
+private:
+    Model() = default;
+
+    llama_model*          model_ = nullptr;
+    const llama_vocab*    vocab_ = nullptr;
+    std::string           pieces_;      // all pieces back to back
+    std::vector<uint32_t> piece_off_;   // n_vocab + 1 offsets into pieces_
+};
+
+struct ContextState;
+
+// One llama_context and its decode engine (batch, slots, prefix KV, grammar).
+// Not thread-safe by itself; hand it between threads through ContextPool.
+class Context {
+public:
+    static std::unique_ptr<Context> create(std::shared_ptr<Model> model, const ContextParams& cp = {});
+    ~Context();
+
+    // Tokenize and decode the constant prompt head once; later prompts that start
+    // with this text only decode what follows it.
+    bool setPrefix(const std::string& prefix);
+    // Constant prompt tail, tokenized once; prompts that end with it (after the
+    // prefix) only tokenize the part in between.
+    void setSuffix(const std::string& suffix);
+    // Prefix KV snapshot (seq 0 + its tokens) via llama_state_seq_*_file. load
+    // only succeeds if the file holds exactly this prefix's tokens; it does not
+    // check which weights produced it, so key the file on the model.
+    bool savePrefixState(const std::string& path) const;
+    bool loadPrefixState(const std::string& path, const std::string& prefix);
+    // Constrain following generations to a GBNF grammar (root rule "root");
+    // an empty string turns constrained decoding off.
+    bool setGrammar(const std::string& gbnf);
+
+    std::string              generate(const std::string& prompt, const GenParams& gp = {},
+                                      const PieceFn& on_piece = {});
+    // Prompts that agree past the prefix share those KV cells: a joining sequence
+    // forks the overlap from a live one instead of decoding it.
+    std::vector<std::string> generateBatch(const std::vector<std::string>& prompts, const GenParams& gp = {});
+
+    // Continuous batching from src: jobs join free slots between decode steps.
+    // Returns once no slot is busy and src has nothing to start.
+    void serve(JobSource& src);
+
+    llama_context* raw() const;
+    SpecStats      specStats() const;
+
+private:
+    Context();
+
+    std::unique_ptr<ContextState> st_;
+};
+
+// Fixed set of contexts over one shared model. Worker threads check a context
+// out for the duration of a job; the Lease gives it back when it goes away.
+class ContextPool {
+public:
+    class Lease {
+    public:
+        Lease(Lease&& o) noexcept : pool_(o.pool_), ctx_(o.ctx_) { o.pool_ = nullptr; o.ctx_ = nullptr; }
+        Lease& operator=(Lease&&) = delete;
+        ~Lease();
+
+        Context* operator->() const { return ctx_; }
+        Context& operator*()  const { return *ctx_; }
+
+    private:
+        friend class ContextPool;
+        Lease(ContextPool* pool, Context* ctx) : pool_(pool), ctx_(ctx) {}
+
+        ContextPool* pool_;
+        Context*     ctx_;
+    };
+
+    // nullptr if any context fails to come up. Thread counts of 0 are split
+    // evenly across the contexts, and so is cp.cpus when pinning.
+    static std::unique_ptr<ContextPool> create(std::shared_ptr<Model> model, const ContextParams& cp,
+                                               int n_contexts);
+
+    Lease acquire();   // blocks until a context is free
+
+    // Apply to every context; waits until each one is idle. Do not call while
+    // holding a Lease from this pool.
+    bool setPrefix(const std::string& prefix);
+    void setSuffix(const std::string& suffix);
+    bool setGrammar(const std::string& gbnf);
+    bool savePrefixState(const std::string& path);   // from any one context
+    bool loadPrefixState(const std::string& path, const std::string& prefix);
+
+    // acquire() + Context::generate, safe to call from any number of threads.
+    std::string              generate(const std::string& prompt, const GenParams& gp = {},
+                                      const PieceFn& on_piece = {});
+    std::vector<std::string> generateBatch(const std::vector<std::string>& prompts, const GenParams& gp = {});
+
+    SpecStats                     specStats() const;   // summed over contexts
+    size_t                        size()  const { return all_.size(); }
+    const std::shared_ptr<Model>& model() const { return model_; }
+
+private:
+    ContextPool() = default;
+    void release(Context* ctx);
+
+    std::shared_ptr<Model>                model_;
+    std::vector<std::unique_ptr<Context>> all_;
+    std::vector<Context*>                 free_;
+    std::mutex                            mu_;
+    std::condition_variable               cv_;
+};
+
+} // namespace lw
@@ -0,0 +1,197 @@
+// Metrics.cpp
+
+#include "Metrics.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+namespace metrics {
+
+namespace {
+
+constexpr int kStages   = (int)Stage::Count;
+constexpr int kCounters = (int)Counter::Count;
+
+// Latency histogram bounds in microseconds (Prometheus "le" buckets).
+constexpr uint64_t kBucketsUs[] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                    100000, 250000, 500000, 1000000, 2500000, 10000000 };
+constexpr int      kBuckets     = sizeof(kBucketsUs) / sizeof(kBucketsUs[0]);
+
+struct StageStats {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> items{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+    std::atomic<uint64_t> buckets[kBuckets + 1] = {};   // last = +Inf
+};
+
+StageStats            g_stage[kStages];
+std::atomic<uint64_t> g_counter[kCounters];
+std::atomic<uint32_t> g_kv_used{0};
+std::atomic<uint32_t> g_kv_peak{0};
+std::atomic<uint32_t> g_kv_size{0};
+std::atomic<int>      g_debug{-1};
+std::atomic<int>      g_gpu_layers{0};
+std::atomic<int>      g_layers{0};
+std::atomic<int>      g_gpus{0};
+
+const char* const kStageNames[kStages]     = { "prompt_build", "tokenize", "prefill", "decode", "extract", "domain_fix" };
+const char* const kCounterNames[kCounters] = { "requests", "errors", "prompt_tokens", "gen_tokens", "cache_hits",
+                                               "shared_tokens", "truncated" };
+
+template <class T>
+void store_max(std::atomic<T>& a, T v) {
+    T cur = a.load(std::memory_order_relaxed);
+    while (v > cur && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+}
+
+} // namespace
+
+void record(Stage s, uint64_t ns, uint64_t n) {
+    StageStats& st = g_stage[(int)s];
+    st.calls.fetch_add(1, std::memory_order_relaxed);
+    st.items.fetch_add(n, std::memory_order_relaxed);
+    st.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    store_max(st.max_ns, ns);
+    const uint64_t us = ns / 1000;
+    int b = 0;
+    while (b < kBuckets && us > kBucketsUs[b]) ++b;
+    st.buckets[b].fetch_add(1, std::memory_order_relaxed);
+}
+
+void add(Counter c, uint64_t n) {
+    g_counter[(int)c].fetch_add(n, std::memory_order_relaxed);
+}
+
+void kvUsage(uint32_t used, uint32_t size) {
+    g_kv_used.store(used, std::memory_order_relaxed);
+    g_kv_size.store(size, std::memory_order_relaxed);
+    store_max(g_kv_peak, used);
+}
+
+void placement(int gpu_layers, int n_layers, int n_gpus) {
+    g_gpu_layers.store(gpu_layers, std::memory_order_relaxed);
+    g_layers.store(n_layers, std::memory_order_relaxed);
+    g_gpus.store(n_gpus, std::memory_order_relaxed);
+}
+
+StageTotals stage(Stage s) {
+    const StageStats& st = g_stage[(int)s];
+    StageTotals t;
+    t.calls    = st.calls.load(std::memory_order_relaxed);
+    t.items    = st.items.load(std::memory_order_relaxed);
+    t.total_ns = st.total_ns.load(std::memory_order_relaxed);
+    return t;
+}
+
+uint64_t counter(Counter c) { return g_counter[(int)c].load(std::memory_order_relaxed); }
+uint32_t kvPeak()           { return g_kv_peak.load(std::memory_order_relaxed); }
+
+static double tokens_per_sec() {
+    const uint64_t ns = g_stage[(int)Stage::Decode].total_ns.load(std::memory_order_relaxed);
+    const uint64_t n  = g_counter[(int)Counter::GenTokens].load(std::memory_order_relaxed);
+    return ns ? (double)n * 1e9 / (double)ns : 0.0;
+}
+
+static double prefill_tokens_per_sec() {
+    const uint64_t ns = g_stage[(int)Stage::Prefill].total_ns.load(std::memory_order_relaxed);
+    const uint64_t n  = g_stage[(int)Stage::Prefill].items.load(std::memory_order_relaxed);
+    return ns ? (double)n * 1e9 / (double)ns : 0.0;
+}
+
+std::string toJson() {
+    std::string o = "{\"stages\":{";
+    char buf[256];
+    for (int i = 0; i < kStages; ++i) {
+        const StageStats& st = g_stage[i];
+        const uint64_t calls = st.calls.load(std::memory_order_relaxed);
+        const uint64_t total = st.total_ns.load(std::memory_order_relaxed);
+        std::snprintf(buf, sizeof(buf), "%s\"%s\":{\"calls\":%llu,\"items\":%llu,\"total_ms\":%.3f,\"mean_us\":%.1f,\"max_us\":%.1f}",
+                      i ? "," : "", kStageNames[i], (unsigned long long)calls,
+                      (unsigned long long)st.items.load(std::memory_order_relaxed), total / 1e6,
+                      calls ? total / 1e3 / (double)calls : 0.0, st.max_ns.load(std::memory_order_relaxed) / 1e3);
+        o += buf;
+    }
+    o += "},\"counters\":{";
+    for (int i = 0; i < kCounters; ++i) {
+        std::snprintf(buf, sizeof(buf), "%s\"%s\":%llu", i ? "," : "", kCounterNames[i],
+                      (unsigned long long)g_counter[i].load(std::memory_order_relaxed));
+        o += buf;
+    }
+    std::snprintf(buf, sizeof(buf),
+                  "},\"tokens_per_sec\":%.2f,\"prefill_tokens_per_sec\":%.2f,"
+                  "\"kv\":{\"used\":%u,\"peak\":%u,\"size\":%u},"
+                  "\"placement\":{\"gpu_layers\":%d,\"n_layers\":%d,\"gpus\":%d}}",
+                  tokens_per_sec(), prefill_tokens_per_sec(), g_kv_used.load(), g_kv_peak.load(), g_kv_size.load(),
+                  g_gpu_layers.load(), g_layers.load(), g_gpus.load());
+    o += buf;
+    return o;
+}
+
+std::string toPrometheus() {
+    std::string o;
+    char buf[512];
+    o += "# HELP workout_stage_seconds Time spent per pipeline stage.\n# TYPE workout_stage_seconds histogram\n";
+    for (int i = 0; i < kStages; ++i) {
+        const StageStats& st = g_stage[i];
+        uint64_t cum = 0;
+        for (int b = 0; b <= kBuckets; ++b) {
+            cum += st.buckets[b].load(std::memory_order_relaxed);
+            if (b < kBuckets)
+                std::snprintf(buf, sizeof(buf), "workout_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                              kStageNames[i], kBucketsUs[b] / 1e6, (unsigned long long)cum);
+            else
+                std::snprintf(buf, sizeof(buf), "workout_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                              kStageNames[i], (unsigned long long)cum);
+            o += buf;
+        }
+        std::snprintf(buf, sizeof(buf), "workout_stage_seconds_sum{stage=\"%s\"} %.9f\nworkout_stage_seconds_count{stage=\"%s\"} %llu\n",
+                      kStageNames[i], st.total_ns.load(std::memory_order_relaxed) / 1e9, kStageNames[i],
+                      (unsigned long long)st.calls.load(std::memory_order_relaxed));
+        o += buf;
+    }
+    for (int i = 0; i < kCounters; ++i) {
+        std::snprintf(buf, sizeof(buf), "# TYPE workout_%s_total counter\nworkout_%s_total %llu\n", kCounterNames[i],
+                      kCounterNames[i], (unsigned long long)g_counter[i].load(std::memory_order_relaxed));
+        o += buf;
+    }
+    std::snprintf(buf, sizeof(buf),
+                  "# TYPE workout_tokens_per_second gauge\nworkout_tokens_per_second %.2f\n"
+                  "# TYPE workout_prefill_tokens_per_second gauge\nworkout_prefill_tokens_per_second %.2f\n"
+                  "# TYPE workout_kv_cells gauge\nworkout_kv_cells{kind=\"used\"} %u\nworkout_kv_cells{kind=\"peak\"} %u\n"
+                  "workout_kv_cells{kind=\"size\"} %u\n",
+                  tokens_per_sec(), prefill_tokens_per_sec(), g_kv_used.load(), g_kv_peak.load(), g_kv_size.load());
+    o += buf;
+    std::snprintf(buf, sizeof(buf),
+                  "# TYPE workout_gpu_layers gauge\nworkout_gpu_layers %d\n"
+                  "# TYPE workout_model_layers gauge\nworkout_model_layers %d\n"
+                  "# TYPE workout_gpus gauge\nworkout_gpus %d\n",
+                  g_gpu_layers.load(), g_layers.load(), g_gpus.load());
+    o += buf;
+    return o;
+}
+
+void reset() {
+    for (StageStats& st : g_stage) {
+        st.calls = 0; st.items = 0; st.total_ns = 0; st.max_ns = 0;
+        for (auto& b : st.buckets) b = 0;
+    }
+    for (auto& c : g_counter) c = 0;
+    g_kv_used = 0; g_kv_peak = 0;
+}
+
+int debugLevel() {
+    int v = g_debug.load(std::memory_order_relaxed);
+    if (v < 0) {
+        const char* env = std::getenv("WORKOUT_DEBUG");
+        v = env ? std::atoi(env) : 0;
+        g_debug.store(v, std::memory_order_relaxed);
+    }
+    return v;
+}
+
+void setDebugLevel(int level) {
+    g_debug.store(level < 0 ? 0 : level, std::memory_order_relaxed);
+}
+
+} // namespace metrics
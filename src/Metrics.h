@@ -0,0 +1,79 @@
+// Metrics.h
+// Process-wide counters and per-stage timers for the plan pipeline, exported
+// as one JSON object or Prometheus text. Lock-free; safe from any thread.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace metrics {
+
+enum class Stage : int {
+    PromptBuild,
+    Tokenize,
+    Prefill,     // time spent decoding prompt tokens (batch time split by token share)
+    Decode,      // generation steps; count = generated tokens
+    Extract,     // JSON validation / repair of the raw output
+    DomainFix,   // rule engine + serialization
+    Count
+};
+
+enum class Counter : int {
+    Requests,
+    Errors,
+    PromptTokens,   // decoded by the engine (excludes the cached prefix)
+    GenTokens,
+    CacheHits,
+    SharedTokens,   // prompt tokens forked from another sequence's KV instead of decoded
+    Truncated,      // outputs cut off by a full context (not by max_tokens or a stop)
+    Count
+};
+
+void record(Stage s, uint64_t ns, uint64_t n = 1);
+void add(Counter c, uint64_t n = 1);
+
+// KV cells in use after a decode step, against the context's size.
+void kvUsage(uint32_t used, uint32_t size);
+
+// Where the serving model's layers went: gpu_layers of n_layers(+1 output
+// head) offloaded over n_gpus. Set when a model is loaded.
+void placement(int gpu_layers, int n_layers, int n_gpus);
+
+struct StageTotals {
+    uint64_t calls    = 0;
+    uint64_t items    = 0;
+    uint64_t total_ns = 0;
+};
+StageTotals stage(Stage s);
+uint64_t    counter(Counter c);
+uint32_t    kvPeak();
+
+std::string toJson();
+std::string toPrometheus();
+void        reset();
+
+// 0 = quiet, 1 = per-request summaries, 2 = also dump raw model output.
+// Starts at $WORKOUT_DEBUG (default 0).
+int  debugLevel();
+void setDebugLevel(int level);
+
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Stage s, uint64_t n = 1) : s_(s), n_(n), t0_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        record(s_, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - t0_).count(), n_);
+    }
+
+    ScopedTimer(const ScopedTimer&)            = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Stage                                 s_;
+    uint64_t                              n_;
+    std::chrono::steady_clock::time_point t0_;
+};
+
+} // namespace metrics
@@ -0,0 +1,118 @@
+// PlanCache.cpp
+
+#include "PlanCache.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+namespace plancache {
+
+uint64_t fnv1a(std::string_view s, uint64_t h) {
+    for (unsigned char c : s) { h ^= c; h *= 0x100000001b3ull; }
+    return h;
+}
+
+uint64_t fingerprintFile(const std::string& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) return 0;
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return 0;
+    std::vector<char> head(1 << 20);
+    f.read(head.data(), (std::streamsize)head.size());
+    uint64_t h = fnv1a(std::string_view(head.data(), (size_t)f.gcount()));
+    h = fnv1a(std::string_view((const char*)&st.st_size, sizeof(st.st_size)), h);
+    h = fnv1a(std::string_view((const char*)&st.st_mtime, sizeof(st.st_mtime)), h);
+    return h;
+}
+
+PlanCache::PlanCache(size_t capacity, std::string dir) : capacity_(capacity), dir_(std::move(dir)) {
+    if (!dir_.empty()) ::mkdir(dir_.c_str(), 0755);   // ok if it already exists
+}
+
+std::string PlanCache::disk_path(const std::string& key) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.plan", (unsigned long long)fnv1a(key));
+    return dir_ + name;
+}
+
+void PlanCache::insert_locked(const std::string& key, const std::string& plan) {
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        it->second->second = plan;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return;
+    }
+    lru_.emplace_front(key, plan);
+    index_.emplace(lru_.front().first, lru_.begin());
+    ++stats_.inserts;
+    while (lru_.size() > capacity_) {
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+        ++stats_.evictions;
+    }
+}
+
+bool PlanCache::get(const std::string& key, std::string& plan) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            plan = it->second->second;
+            ++stats_.hits;
+            return true;
+        }
+    }
+    if (!dir_.empty()) {
+        std::ifstream f(disk_path(key), std::ios::binary);
+        std::string stored;
+        if (f && std::getline(f, stored) && stored == key) {
+            std::ostringstream rest;
+            rest << f.rdbuf();
+            plan = rest.str();
+            std::lock_guard<std::mutex> lk(mu_);
+            if (capacity_ > 0) insert_locked(key, plan);
+            ++stats_.hits;
+            ++stats_.disk_hits;
+            return true;
+        }
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    ++stats_.misses;
+    return false;
+}
+
+void PlanCache::put(const std::string& key, const std::string& plan) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (capacity_ > 0) insert_locked(key, plan);
+    }
+    if (dir_.empty()) return;
+    const std::string path = disk_path(key);
+    const std::string tmp  = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f) { std::remove(tmp.c_str()); return; }
+        f << key << '\n' << plan;
+        if (!f) { f.close(); std::remove(tmp.c_str()); return; }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) std::remove(tmp.c_str());
+}
+
+void PlanCache::clear() {
+    std::lock_guard<std::mutex> lk(mu_);
+    index_.clear();
+    lru_.clear();
+}
+
+Stats PlanCache::stats() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    Stats s = stats_;
+    s.entries = lru_.size();
+    return s;
+}
+
+} // namespace plancache
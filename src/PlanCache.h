@@ -0,0 +1,56 @@
+// PlanCache.h
+// LRU of finished plans keyed on (canonical profile, model fingerprint, decode
+// settings), optionally mirrored to a directory so results survive restarts.
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace plancache {
+
+struct Stats {
+    uint64_t hits      = 0;   // memory + disk
+    uint64_t disk_hits = 0;
+    uint64_t misses    = 0;
+    uint64_t inserts   = 0;
+    uint64_t evictions = 0;
+    size_t   entries   = 0;
+};
+
+// Thread-safe. Disk entries are one file per key, written via rename so readers
+// never see a partial plan; the key is stored in the file and checked on read.
+class PlanCache {
+public:
+    explicit PlanCache(size_t capacity, std::string dir = {});
+
+    bool  get(const std::string& key, std::string& plan);
+    void  put(const std::string& key, const std::string& plan);
+    void  clear();   // memory only
+    Stats stats() const;
+
+private:
+    using Entry = std::pair<std::string, std::string>;   // key, plan
+
+    void insert_locked(const std::string& key, const std::string& plan);
+    std::string disk_path(const std::string& key) const;
+
+    size_t                                                         capacity_;
+    std::string                                                    dir_;
+    mutable std::mutex                                             mu_;
+    std::list<Entry>                                               lru_;   // front = most recent
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_; // views into lru_ keys
+    Stats                                                          stats_;
+};
+
+uint64_t fnv1a(std::string_view s, uint64_t h = 0xcbf29ce484222325ull);
+
+// Cheap identity for a model file: size, mtime and a hash of the first MiB
+// (the GGUF header + metadata). 0 if the file can't be read.
+uint64_t fingerprintFile(const std::string& path);
+
+} // namespace plancache
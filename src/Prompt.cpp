@@ -1,37 +1,115 @@
 // Prompt.cpp
 // Build LLM input prompt (system constraints + user profile JSON).
+//
+// A prompt is  head + profile JSON + tail. head and tail are constant: the
+// built-in ones are joined at compile time, or they are cut once per loaded
+// model from its own chat template rendered around a sentinel user message.
 
+#include "Prompt.h"
+#include "JsonUtil.h"
+#include <cstddef>
 #include <string>
+#include <string_view>
 
 namespace prompt {
-std::string buildPrompt(const std::string& profile_json) {
-    static const char* kSys =
-        "<|system|>\n"
-        "You are a certified strength & conditioning coach.\n"
-        "Follow these constraints:\n"
-        "- progressive overload <= 10% per week\n"
-        "- 1-2 rest days per week\n"
-        "- deload every 4th week\n"
-        "- respect injuries (swap with low-impact work)\n\n"
-        "Your output MUST be a valid JSON object.\n"
-        "Do not write any explanations, markdown, or text outside JSON.\n"
-        "JSON schema:\n"
-        "{\n"
-        "  \"goal\": string,\n"
-        "  \"weeks\": [\n"
-        "    {\"week\": number, \"sessions\": [string, ...]}\n"
-        "  ],\n"
-        "  \"rest_days\": [string, ...]\n"
-        "}\n";
 
+namespace {
+
+// Fixed-size string joined from literals at compile time.
+template <size_t N>
+struct Literal {
+    char buf[N + 1] = {};
+    constexpr std::string_view view() const { return std::string_view(buf, N); }
+};
+
+constexpr void append(char* dst, size_t& at, const char* s, size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[at++] = s[i];
+}
+
+template <size_t... N>
+constexpr Literal<(0 + ... + (N - 1))> join(const char (&... parts)[N]) {
+    Literal<(0 + ... + (N - 1))> out;
+    size_t at = 0;
+    (append(out.buf, at, parts, N - 1), ...);
+    return out;
+}
+
+constexpr char kRules[] =
+    "You are a certified strength & conditioning coach.\n"
+    "Follow these constraints:\n"
+    "- progressive overload <= 10% per week\n"
+    "- 1-2 rest days per week\n"
+    "- deload every 4th week\n"
+    "- respect injuries (swap with low-impact work)\n\n"
+    "Your output MUST be a valid JSON object.\n"
+    "Do not write any explanations, markdown, or text outside JSON.\n"
+    "JSON schema:\n"
+    "{\n"
+    "  \"goal\": string,\n"
+    "  \"weeks\": [\n"
+    "    {\"week\": number, \"sessions\": [string, ...]}\n"
+    "  ],\n"
+    "  \"rest_days\": [string, ...]\n"
+    "}\n";
+
+constexpr char kUserLead[] = "User profile JSON:\n";
+constexpr char kUserTail[] = "\n\nReturn ONLY the training plan as JSON.";
+// Stands in for the profile when rendering a chat template; never in a profile.
+constexpr char kSentinel[] = "\x01PROFILE\x01";
+
+// Built-in template: <|system|> / <|user|> / <|assistant|>.
+constexpr auto kBuiltinHead = join("<|system|>\n", kRules, "\n<|user|>\n", kUserLead);
+constexpr auto kBuiltinTail = join(kUserTail, "\n<|assistant|>\n"); // assistant的起始符
+constexpr auto kUserMessage = join(kUserLead, kSentinel, kUserTail);
+
+} // namespace
+
+std::string_view systemText()  { return std::string_view(kRules, sizeof(kRules) - 1); }
+std::string_view userMessage() { return kUserMessage.view(); }
+
+Template builtinTemplate() {
+    return Template{ std::string(kBuiltinHead.view()), std::string(kBuiltinTail.view()) };
+}
+
+// Splits at the sentinel; false unless it is there exactly once.
+bool fromRendered(std::string_view rendered, Template& out) {
+    const std::string_view sentinel(kSentinel, sizeof(kSentinel) - 1);
+    const size_t at = rendered.find(sentinel);
+    if (at == std::string_view::npos || rendered.find(sentinel, at + 1) != std::string_view::npos) return false;
+    out.head.assign(rendered.substr(0, at));
+    out.tail.assign(rendered.substr(at + sentinel.size()));
+    return true;
+}
+
+// GBNF for the schema above: fixed key order, integer week numbers, bounded
+// whitespace. The grammar ends at the root '}', so only EOS may follow it.
+static const char* kPlanGrammar = R"gbnf(
+root     ::= "{" ws "\"goal\"" ws ":" ws string ws "," ws "\"weeks\"" ws ":" ws weeks ws "," ws "\"rest_days\"" ws ":" ws strings ws "}"
+weeks    ::= "[" ws ( week ( ws "," ws week )* )? ws "]"
+week     ::= "{" ws "\"week\"" ws ":" ws number ws "," ws "\"sessions\"" ws ":" ws strings ws "}"
+strings  ::= "[" ws ( string ( ws "," ws string )* )? ws "]"
+string   ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" ( ["\\/bfnrt] | "u" [0-9a-fA-F]{4} ) )* "\""
+number   ::= [0-9] [0-9]?
+ws       ::= | " " | "\n" [ \t]{0,8}
+)gbnf";
+
+const std::string& planGrammar() {
+    static const std::string s = kPlanGrammar;
+    return s;
+}
+
+std::string buildPrompt(const Template& t, const std::string& profile_json) {
     std::string p;
-    p.reserve(512 + profile_json.size());
-    p += kSys;
-    p += "\n<|user|>\n";
-    p += "User profile JSON:\n";
+    p.reserve(t.head.size() + profile_json.size() + t.tail.size());
+    p += t.head;
     p += profile_json;
-    p += "\n\nReturn ONLY the training plan as JSON.";
-    p += "\n<|assistant|>\n"; // assistant的起始符
+    p += t.tail;
     return p;
 }
-}
\ No newline at end of file
+
+std::string minimalProfile(std::string_view goal) {
+    // Keep it tiny; extend with more fields as you like.
+    return "{\"goal\":\"" + jsonutil::escape(goal) + "\",\"horizon_weeks\":8,\"sessions_per_week\":4}";
+}
+
+} // namespace prompt
@@ -0,0 +1,33 @@
+// Prompt.h
+// LLM input prompt: constant head (coach rules + schema, user lead-in) +
+// profile JSON + constant tail (closing instruction, assistant header).
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace prompt {
+
+struct Template {
+    std::string head;   // before the profile; lw keeps its KV resident
+    std::string tail;   // after it; lw keeps it tokenized
+};
+
+// <|system|> / <|user|> / <|assistant|>, joined at compile time.
+Template builtinTemplate();
+
+// Render a chat template with {system: systemText(), user: userMessage()} plus
+// the assistant header; fromRendered cuts that into head and tail. false if
+// the rendering lost the profile placeholder.
+std::string_view systemText();
+std::string_view userMessage();
+bool             fromRendered(std::string_view rendered, Template& out);
+
+const std::string& planGrammar();
+std::string        buildPrompt(const Template& t, const std::string& profile_json);
+
+// Profile JSON for a bare goal string (the CLI and bench accept either).
+std::string        minimalProfile(std::string_view goal);
+
+} // namespace prompt
@@ -0,0 +1,216 @@
+// Sampler.cpp
+// Scalar reference paths plus AVX2 / NEON kernels for the per-token hot loop.
+
+#include "Sampler.h"
+#include <algorithm>
+#include <cmath>
+
+// x86-64: the AVX2 kernels are compiled for AVX2 on their own and picked at
+// run time, so a baseline (SSE2) build still uses them where the CPU has it.
+// aarch64: NEON is part of the baseline.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SAMPLING_AVX2 1
+#include <immintrin.h>
+#define AVX2_FN __attribute__((target("avx2")))
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace sampling {
+
+static int argmax_scalar(const float* x, int begin, int n, int best) {
+    float v = x[best];
+    for (int i = begin; i < n; ++i) if (x[i] > v) { v = x[i]; best = i; }
+    return best;
+}
+
+#if defined(SAMPLING_AVX2)
+static bool has_avx2() {
+#if defined(__AVX2__)
+    return true;
+#else
+    static const bool v = __builtin_cpu_supports("avx2");
+    return v;
+#endif
+}
+
+// Lane-wise running max with lane-wise index; strict '>' keeps the first index
+// per lane, and the final reduction prefers the lowest index on ties. n >= 16.
+AVX2_FN static int argmax_avx2(const float* x, int n) {
+    __m256  best = _mm256_loadu_ps(x);
+    __m256i bidx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i idx  = bidx;
+    const __m256i inc = _mm256_set1_epi32(8);
+    int i = 8;
+    for (; i + 8 <= n; i += 8) {
+        idx = _mm256_add_epi32(idx, inc);
+        const __m256 v = _mm256_loadu_ps(x + i);
+        const __m256 m = _mm256_cmp_ps(v, best, _CMP_GT_OQ);
+        best = _mm256_blendv_ps(best, v, m);
+        bidx = _mm256_blendv_epi8(bidx, idx, _mm256_castps_si256(m));
+    }
+    alignas(32) float   bv[8];
+    alignas(32) int32_t bi[8];
+    _mm256_store_ps(bv, best);
+    _mm256_store_si256((__m256i*)bi, bidx);
+    int b = bi[0];
+    for (int l = 1; l < 8; ++l)
+        if (bv[l] > x[b] || (bv[l] == x[b] && bi[l] < b)) b = bi[l];
+    return argmax_scalar(x, i, n, b);
+}
+
+// Blocks of 8 against the current threshold; push runs only for lanes that
+// beat it (and may raise thr). Returns where the scalar tail starts.
+template <class Push>
+AVX2_FN static int topk_scan_avx2(const float* x, int i, int n, const float& thr, Push& push) {
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(x + i);
+        int m = _mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_set1_ps(thr), _CMP_GT_OQ));
+        while (m) {
+            const int l = __builtin_ctz(m);
+            m &= m - 1;
+            push(i + l);
+        }
+    }
+    return i;
+}
+#endif
+
+int argmax(const float* x, int n) {
+    if (n <= 0) return -1;
+#if defined(SAMPLING_AVX2)
+    if (n >= 16 && has_avx2()) return argmax_avx2(x, n);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (n >= 8) {
+        float32x4_t best = vld1q_f32(x);
+        const uint32_t lanes[4] = { 0, 1, 2, 3 };
+        uint32x4_t bidx = vld1q_u32(lanes);
+        uint32x4_t idx  = bidx;
+        const uint32x4_t inc = vdupq_n_u32(4);
+        int i = 4;
+        for (; i + 4 <= n; i += 4) {
+            idx = vaddq_u32(idx, inc);
+            const float32x4_t v = vld1q_f32(x + i);
+            const uint32x4_t  m = vcgtq_f32(v, best);
+            best = vbslq_f32(m, v, best);
+            bidx = vbslq_u32(m, idx, bidx);
+        }
+        float    bv[4];
+        uint32_t bi[4];
+        vst1q_f32(bv, best);
+        vst1q_u32(bi, bidx);
+        int b = (int)bi[0];
+        for (int l = 1; l < 4; ++l)
+            if (bv[l] > x[b] || (bv[l] == x[b] && (int)bi[l] < b)) b = (int)bi[l];
+        return argmax_scalar(x, i, n, b);
+    }
+#endif
+    return argmax_scalar(x, 1, n, 0);
+}
+
+// Min-heap of the k best seen so far; SIMD compares a block against the heap's
+// minimum so the scalar insert only runs for the (rare) lanes that beat it.
+void topK(const float* x, int n, int k, std::vector<Candidate>& out) {
+    out.clear();
+    k = std::min(k, n);
+    if (k <= 0) return;
+
+    auto worse = [](const Candidate& a, const Candidate& b) { return a.logit > b.logit; };
+    float thr = -INFINITY;
+    auto push = [&](int i) {
+        if ((int)out.size() < k) {
+            out.push_back({ i, x[i] });
+            std::push_heap(out.begin(), out.end(), worse);
+            if ((int)out.size() == k) thr = out.front().logit;
+        } else if (x[i] > thr) {
+            std::pop_heap(out.begin(), out.end(), worse);
+            out.back() = { i, x[i] };
+            std::push_heap(out.begin(), out.end(), worse);
+            thr = out.front().logit;
+        }
+    };
+
+    int i = 0;
+    for (; i < n && (int)out.size() < k; ++i) push(i);
+#if defined(SAMPLING_AVX2)
+    if (has_avx2()) i = topk_scan_avx2(x, i, n, thr, push);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= n; i += 4) {
+        const uint32x4_t m = vcgtq_f32(vld1q_f32(x + i), vdupq_n_f32(thr));
+        if (vmaxvq_u32(m) == 0) continue;
+        for (int l = 0; l < 4; ++l) push(i + l);
+    }
+#endif
+    for (; i < n; ++i) push(i);
+
+    std::sort(out.begin(), out.end(), [](const Candidate& a, const Candidate& b) {
+        return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+    });
+}
+
+Sampler::Sampler(const Params& p)
+    : p_(p), rng_(p.seed ? p.seed : std::random_device{}()) {
+    if (p_.repeat_penalty != 1.0f && p_.repeat_last_n > 0) hist_.reserve(p_.repeat_last_n);
+}
+
+void Sampler::accept(int tok) {
+    if (p_.repeat_penalty == 1.0f || p_.repeat_last_n <= 0) return;
+    if ((int)hist_.size() < p_.repeat_last_n) { hist_.push_back(tok); return; }
+    hist_[hist_pos_] = tok;
+    hist_pos_ = (hist_pos_ + 1) % hist_.size();
+}
+
+int Sampler::sample(const float* logits, int n_vocab) {
+    const bool greedy  = p_.temperature <= 0.0f;
+    const bool penalty = !hist_.empty();
+    if (greedy && !penalty) return argmax(logits, n_vocab);
+
+    int k = greedy ? 1 : (p_.top_k > 0 ? p_.top_k : n_vocab);
+
+    if (penalty) {
+        // The penalty only lowers logits of recent tokens, so the top k after it
+        // are among the top k + |history| before it.
+        topK(logits, n_vocab, k + (int)hist_.size(), cand_);
+        for (Candidate& c : cand_) {
+            if (std::find(hist_.begin(), hist_.end(), c.id) == hist_.end()) continue;
+            c.logit = c.logit > 0.0f ? c.logit / p_.repeat_penalty : c.logit * p_.repeat_penalty;
+        }
+        k = std::min<int>(k, (int)cand_.size());
+        std::partial_sort(cand_.begin(), cand_.begin() + k, cand_.end(),
+                          [](const Candidate& a, const Candidate& b) { return a.logit > b.logit; });
+        cand_.resize(k);
+    } else {
+        topK(logits, n_vocab, k, cand_);
+    }
+    if (cand_.empty()) return -1;
+    if (greedy) return cand_[0].id;
+
+    // temperature + softmax over the (sorted) candidates, then the top-p cut
+    prob_.resize(cand_.size());
+    const float inv_t = 1.0f / p_.temperature;
+    const float mx    = cand_[0].logit;
+    float sum = 0.0f;
+    for (size_t i = 0; i < cand_.size(); ++i) {
+        prob_[i] = std::exp((cand_[i].logit - mx) * inv_t);
+        sum += prob_[i];
+    }
+    size_t keep = cand_.size();
+    if (p_.top_p < 1.0f) {
+        float cum = 0.0f;
+        for (size_t i = 0; i < cand_.size(); ++i) {
+            cum += prob_[i] / sum;
+            if (cum >= p_.top_p) { keep = i + 1; break; }
+        }
+        sum = 0.0f;
+        for (size_t i = 0; i < keep; ++i) sum += prob_[i];
+    }
+
+    float r = std::uniform_real_distribution<float>(0.0f, sum)(rng_);
+    for (size_t i = 0; i < keep; ++i) {
+        r -= prob_[i];
+        if (r <= 0.0f) return cand_[i].id;
+    }
+    return cand_[keep - 1].id;
+}
+
+} // namespace sampling
@@ -0,0 +1,53 @@
+// Sampler.h
+// Token selection over a logits row: greedy, top-k, top-p, temperature,
+// repetition penalty. SIMD argmax/top-k kernels for AVX2 and NEON.
+
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace sampling {
+
+struct Params {
+    float    temperature    = 0.0f;   // <= 0: greedy
+    int      top_k          = 40;     // <= 0: whole vocab
+    float    top_p          = 0.95f;  // 1: off
+    float    repeat_penalty = 1.0f;   // 1: off
+    int      repeat_last_n  = 64;     // tokens of history the penalty looks at
+    uint32_t seed           = 0;      // 0: nondeterministic
+};
+
+struct Candidate {
+    int   id;
+    float logit;
+};
+
+// Index of the largest logit (first one on ties).
+int argmax(const float* logits, int n);
+
+// The k largest logits, sorted descending, written to out.
+void topK(const float* logits, int n, int k, std::vector<Candidate>& out);
+
+// Per-sequence sampler: owns its RNG, penalty history and scratch buffers.
+class Sampler {
+public:
+    Sampler() = default;
+    explicit Sampler(const Params& p);
+
+    int  sample(const float* logits, int n_vocab);
+    void accept(int tok);
+
+    const Params& params() const { return p_; }
+
+private:
+    Params                 p_;
+    std::mt19937           rng_;
+    std::vector<int>       hist_;       // ring of the last repeat_last_n tokens
+    size_t                 hist_pos_ = 0;
+    std::vector<Candidate> cand_;
+    std::vector<float>     prob_;
+};
+
+} // namespace sampling
@@ -0,0 +1,247 @@
+// WorkoutC.cpp
+// extern "C" wrapper over core::. Every entry point catches; errors come back
+// as workout_result::error or a nonzero / NULL return.
+
+#define WORKOUT_C_BUILD
+#include "WorkoutC.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <string>
+
+#include "CoreFacade.h"
+
+namespace {
+
+// The public struct points into the strings it owns.
+struct Result : workout_result {
+    std::string text;
+    std::string err;
+};
+
+workout_result* make_result(std::string text, std::string err = {}) {
+    Result* r = new Result();
+    r->text   = std::move(text);
+    r->err    = std::move(err);
+    r->data   = r->text.c_str();
+    r->size   = r->text.size();
+    r->error  = r->err.empty() ? nullptr : r->err.c_str();
+    return r;
+}
+
+// Fields past what the caller's struct_size covers keep their defaults.
+template <class T>
+T read_struct(const T* in, void (*init)(T*)) {
+    T out;
+    init(&out);
+    if (in && in->struct_size > sizeof(size_t))
+        std::memcpy((char*)&out + sizeof(size_t), (const char*)in + sizeof(size_t),
+                    std::min(in->struct_size, sizeof(T)) - sizeof(size_t));
+    out.struct_size = sizeof(T);
+    return out;
+}
+
+lw::GenParams gen_params(const workout_request& r) {
+    lw::GenParams gp;
+    gp.max_tokens           = r.max_tokens > 0 ? r.max_tokens : 10240;
+    gp.sampling.temperature = r.temperature;
+    gp.sampling.top_k       = r.top_k;
+    gp.sampling.top_p       = r.top_p;
+    gp.sampling.seed        = r.seed;
+    return gp;
+}
+
+lw::PieceFn piece_fn(const workout_request& r) {
+    if (!r.on_piece) return {};
+    workout_piece_cb cb = r.on_piece;
+    void* user          = r.user;
+    return [cb, user](const std::string& piece) { return cb(piece.data(), piece.size(), user) != 0; };
+}
+
+} // namespace
+
+struct workout_ticket {
+    core::Ticket t;
+    bool         taken = false;
+};
+
+extern "C" {
+
+int workout_api_version(void) { return WORKOUT_API_VERSION; }
+
+void workout_options_init(workout_options* opt) {
+    if (!opt) return;
+    const core::Options d;
+    std::memset(opt, 0, sizeof(*opt));
+    opt->struct_size     = sizeof(*opt);
+    opt->n_ctx           = d.n_ctx;
+    opt->n_gpu_layers    = d.n_gpu_layers;
+    opt->n_parallel      = d.n_parallel;
+    opt->n_contexts      = d.n_contexts;
+    opt->n_threads       = d.n_threads;
+    opt->n_threads_batch = d.n_threads_batch;
+    opt->use_mlock       = d.use_mlock;
+    opt->constrained     = 1;
+    opt->cache_entries   = (int32_t)d.cache_entries;
+    opt->n_draft         = d.n_draft;
+    opt->n_lookup        = d.n_lookup;
+    opt->debug_level     = d.debug_level;
+    opt->kv_type         = WORKOUT_KV_F16;
+    opt->flash_attn      = d.flash_attn;
+    opt->ctx_gen_tokens  = d.ctx_gen_tokens;
+    opt->kv_mem_mb       = (int32_t)d.kv_mem_mb;
+    opt->split_mode      = (int32_t)d.split_mode;
+    opt->main_gpu        = d.main_gpu;
+}
+
+void workout_request_init(workout_request* req) {
+    if (!req) return;
+    const sampling::Params d;
+    std::memset(req, 0, sizeof(*req));
+    req->struct_size = sizeof(*req);
+    req->max_tokens  = 10240;
+    req->priority    = WORKOUT_INTERACTIVE;
+    req->temperature = d.temperature;
+    req->top_k       = d.top_k;
+    req->top_p       = d.top_p;
+    req->seed        = d.seed;
+}
+
+int workout_init(const char* model_path, const workout_options* in) {
+    if (!model_path) return -1;
+    try {
+        const workout_options o = read_struct(in, workout_options_init);
+        core::Options opt;
+        opt.n_ctx           = o.n_ctx;
+        opt.n_gpu_layers    = o.n_gpu_layers;
+        opt.n_parallel      = o.n_parallel > 0 ? o.n_parallel : 1;
+        opt.n_contexts      = o.n_contexts > 0 ? o.n_contexts : 1;
+        opt.n_threads       = o.n_threads;
+        opt.n_threads_batch = o.n_threads_batch;
+        opt.use_mlock       = o.use_mlock != 0;
+        opt.cache_entries   = (size_t)(o.cache_entries > 0 ? o.cache_entries : 0);
+        if (o.cache_dir)        opt.cache_dir        = o.cache_dir;
+        if (o.session_path)     opt.session_path     = o.session_path;
+        if (o.draft_model_path) opt.draft_model_path = o.draft_model_path;
+        opt.n_draft         = o.n_draft > 0 ? o.n_draft : 8;
+        opt.n_lookup        = o.n_lookup;
+        opt.debug_level     = o.debug_level;
+        opt.kv_type         = o.kv_type == WORKOUT_KV_Q8_0 ? lw::KvType::Q8_0
+                            : o.kv_type == WORKOUT_KV_Q4_0 ? lw::KvType::Q4_0 : lw::KvType::F16;
+        opt.flash_attn      = o.flash_attn != 0;
+        opt.ctx_gen_tokens  = o.ctx_gen_tokens > 0 ? o.ctx_gen_tokens : 2048;
+        opt.kv_mem_mb       = (size_t)(o.kv_mem_mb > 0 ? o.kv_mem_mb : 0);
+        opt.split_mode      = o.split_mode == WORKOUT_SPLIT_NONE ? lw::SplitMode::None
+                            : o.split_mode == WORKOUT_SPLIT_ROW  ? lw::SplitMode::Row : lw::SplitMode::Layer;
+        opt.main_gpu        = o.main_gpu > 0 ? o.main_gpu : 0;
+        if (o.tensor_split)     opt.tensor_split     = o.tensor_split;
+        if (!core::init(model_path, opt)) return 1;
+        if (!o.constrained) core::setConstrainedDecoding(false);
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "[workout_c] init: " << e.what() << "\n";
+        return -1;
+    }
+}
+
+void workout_shutdown(void) {
+    try {
+        core::shutdown();
+    } catch (const std::exception& e) {
+        std::cerr << "[workout_c] shutdown: " << e.what() << "\n";
+    }
+}
+
+int workout_swap_model(const char* model_path) {
+    if (!model_path) return -1;
+    try {
+        return core::swapModel(model_path).get() ? 0 : -1;
+    } catch (const std::exception& e) {
+        std::cerr << "[workout_c] swap: " << e.what() << "\n";
+        return -1;
+    }
+}
+
+workout_result* workout_generate(const char* profile_json, const workout_request* in) {
+    if (!profile_json) return make_result({}, "null profile");
+    try {
+        const workout_request r = read_struct(in, workout_request_init);
+        const lw::GenParams  gp = gen_params(r);
+        if (!r.on_piece) return make_result(core::generatePlan(profile_json, gp));
+        core::StreamHandlers h;
+        h.on_piece = piece_fn(r);
+        return make_result(core::generatePlanStream(profile_json, gp, h));
+    } catch (const std::exception& e) {
+        return make_result({}, e.what());
+    }
+}
+
+workout_result* workout_update(const char* previous_plan, const char* profile_json, const char* profile_delta,
+                               int32_t from_week, const workout_request* in) {
+    if (!previous_plan || !profile_json) return make_result({}, "null plan or profile");
+    try {
+        const workout_request r = read_struct(in, workout_request_init);
+        return make_result(core::updatePlan(previous_plan, profile_json, profile_delta ? profile_delta : "",
+                                            from_week, gen_params(r)));
+    } catch (const std::exception& e) {
+        return make_result({}, e.what());
+    }
+}
+
+workout_ticket* workout_submit(const char* profile_json, const workout_request* in) {
+    if (!profile_json) return nullptr;
+    try {
+        const workout_request r = read_struct(in, workout_request_init);
+        core::SubmitOptions so;
+        so.priority   = r.priority == WORKOUT_BATCH ? core::Priority::Batch : core::Priority::Interactive;
+        so.timeout_ms = r.timeout_ms;
+        so.on_piece   = piece_fn(r);
+        workout_ticket* t = new workout_ticket();
+        t->t = core::submitPlan(profile_json, gen_params(r), so);
+        return t;
+    } catch (const std::exception& e) {
+        std::cerr << "[workout_c] submit: " << e.what() << "\n";
+        return nullptr;
+    }
+}
+
+workout_result* workout_ticket_wait(workout_ticket* t, int32_t timeout_ms) {
+    if (!t || t->taken || !t->t.plan.valid()) return nullptr;
+    if (timeout_ms >= 0 &&
+        t->t.plan.wait_for(std::chrono::milliseconds(timeout_ms)) != std::future_status::ready)
+        return nullptr;
+    t->taken = true;
+    try {
+        return make_result(t->t.plan.get());
+    } catch (const std::exception& e) {
+        return make_result({}, e.what());
+    }
+}
+
+void workout_ticket_cancel(workout_ticket* t) {
+    if (t) t->t.cancel();
+}
+
+void workout_ticket_free(workout_ticket* t) {
+    if (!t) return;
+    if (!t->taken) t->t.cancel();
+    delete t;
+}
+
+workout_result* workout_metrics(int prometheus) {
+    try {
+        return make_result(prometheus ? core::metricsPrometheus() : core::metricsJson());
+    } catch (const std::exception& e) {
+        return make_result({}, e.what());
+    }
+}
+
+void workout_result_free(workout_result* r) {
+    delete static_cast<Result*>(r);
+}
+
+} // extern "C"
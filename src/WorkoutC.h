@@ -0,0 +1,132 @@
+/* WorkoutC.h
+ * Stable C ABI over the plan pipeline (libworkout), for embedding one resident
+ * model in another process, e.g. Python via ctypes. No C++ types cross this
+ * boundary and no exceptions escape it.
+ *
+ * Results are library-owned buffers: read data/size in place, then hand the
+ * result back with workout_result_free. Structs passed in start with
+ * struct_size so fields can be appended without breaking older callers;
+ * fill them with the *_init functions first.
+ */
+
+#ifndef WORKOUT_C_H
+#define WORKOUT_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#  if defined(WORKOUT_C_BUILD)
+#    define WORKOUT_API __declspec(dllexport)
+#  else
+#    define WORKOUT_API __declspec(dllimport)
+#  endif
+#else
+#  define WORKOUT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WORKOUT_API_VERSION 1
+
+enum { WORKOUT_KV_F16 = 0, WORKOUT_KV_Q8_0 = 1, WORKOUT_KV_Q4_0 = 2 };
+enum { WORKOUT_GPU_LAYERS_ALL = -1, WORKOUT_GPU_LAYERS_AUTO = -2 };
+enum { WORKOUT_SPLIT_NONE = 0, WORKOUT_SPLIT_LAYER = 1, WORKOUT_SPLIT_ROW = 2 };
+
+typedef struct workout_options {
+    size_t      struct_size;
+    int32_t     n_ctx;              /* 0 = size from the prompt and ctx_gen_tokens */
+    int32_t     n_gpu_layers;       /* 0 (default) = CPU only, a count, or WORKOUT_GPU_LAYERS_ALL / _AUTO */
+    int32_t     n_parallel;
+    int32_t     n_contexts;
+    int32_t     n_threads;          /* 0 = auto */
+    int32_t     n_threads_batch;    /* 0 = auto */
+    int32_t     use_mlock;
+    int32_t     constrained;        /* grammar-constrained decoding, default 1 */
+    int32_t     cache_entries;
+    const char* cache_dir;          /* NULL = memory only */
+    const char* session_path;       /* NULL = no prefix snapshot */
+    const char* draft_model_path;   /* NULL = no speculative decoding */
+    int32_t     n_draft;
+    int32_t     n_lookup;
+    int32_t     debug_level;        /* -1 = $WORKOUT_DEBUG */
+    int32_t     kv_type;            /* WORKOUT_KV_F16 / _Q8_0 / _Q4_0 */
+    int32_t     flash_attn;
+    int32_t     ctx_gen_tokens;     /* with n_ctx = 0 (automatic) */
+    int32_t     kv_mem_mb;
+    int32_t     split_mode;         /* WORKOUT_SPLIT_*, across several GPUs */
+    int32_t     main_gpu;
+    const char* tensor_split;       /* per-GPU shares, e.g. "3,1"; NULL = by free memory */
+} workout_options;
+
+/* Streamed raw model text (not NUL-terminated). Return 0 to stop early. */
+typedef int (*workout_piece_cb)(const char* piece, size_t size, void* user);
+
+enum { WORKOUT_INTERACTIVE = 0, WORKOUT_BATCH = 1 };
+
+typedef struct workout_request {
+    size_t           struct_size;
+    int32_t          max_tokens;    /* default 10240 */
+    int32_t          priority;      /* WORKOUT_INTERACTIVE / WORKOUT_BATCH (submit only) */
+    int32_t          timeout_ms;    /* 0 = none (submit only) */
+    float            temperature;   /* <= 0: greedy */
+    int32_t          top_k;
+    float            top_p;
+    uint32_t         seed;          /* 0: nondeterministic */
+    workout_piece_cb on_piece;      /* optional */
+    void*            user;
+} workout_request;
+
+typedef struct workout_result {
+    const char* data;    /* NUL-terminated plan JSON (or stats text); "" on error */
+    size_t      size;
+    const char* error;   /* NULL on success */
+} workout_result;
+
+typedef struct workout_ticket workout_ticket;
+
+WORKOUT_API int  workout_api_version(void);
+WORKOUT_API void workout_options_init(workout_options* opt);
+WORKOUT_API void workout_request_init(workout_request* req);
+
+/* 0 on success. Not thread-safe with respect to each other or to generation. */
+WORKOUT_API int  workout_init(const char* model_path, const workout_options* opt);
+WORKOUT_API void workout_shutdown(void);
+
+/* Load model_path next to the live model and switch new requests to it once
+ * it is warm; in-flight ones finish on the old model, which is then freed.
+ * Blocks the caller until the switch (other threads keep generating); 0 on
+ * success, -1 if the load failed and the old model still serves. */
+WORKOUT_API int  workout_swap_model(const char* model_path);
+
+/* Blocking; safe from many threads. req may be NULL for defaults. */
+WORKOUT_API workout_result* workout_generate(const char* profile_json, const workout_request* req);
+
+/* Regenerate previous_plan from from_week (1-based) on; earlier weeks are kept
+ * and prefilled rather than decoded. profile_delta may be NULL. */
+WORKOUT_API workout_result* workout_update(const char* previous_plan, const char* profile_json,
+                                           const char* profile_delta, int32_t from_week,
+                                           const workout_request* req);
+
+/* Async: queued by priority, batched with other requests. on_piece runs on a
+ * library thread. */
+WORKOUT_API workout_ticket* workout_submit(const char* profile_json, const workout_request* req);
+/* Waits up to timeout_ms (-1 = forever). NULL while not ready; the result is
+ * returned once, later calls get NULL. */
+WORKOUT_API workout_result* workout_ticket_wait(workout_ticket* t, int32_t timeout_ms);
+WORKOUT_API void            workout_ticket_cancel(workout_ticket* t);
+/* Cancels the request if it is still running. */
+WORKOUT_API void            workout_ticket_free(workout_ticket* t);
+
+/* Pipeline metrics as JSON (prometheus = 0) or Prometheus text. */
+WORKOUT_API workout_result* workout_metrics(int prometheus);
+
+WORKOUT_API void workout_result_free(workout_result* r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WORKOUT_C_H */
@@ -1,41 +1,291 @@
 // main.cpp
 // CLI demo: read a simple goal -> call core pipeline -> print JSON plan.
+// With --serve, keep the model resident and answer one request per stdin line;
+// with --batch, turn a JSONL file of profiles into a JSONL file of plans.
 
 #include <iostream>
 #include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <thread>
+#include <vector>
 
-// Facade API
-namespace core {
-    bool        init(const std::string& model_path, int n_ctx = 2048, int n_gpu_layers = 0);
-    std::string generatePlan(const std::string& user_profile_json, int max_tokens = 512);
-    void        shutdown();
+#include "CoreFacade.h"
+#include "JsonUtil.h"
+#include "Prompt.h"
+
+static std::string trimmed(const std::string& line) {
+    const size_t l = line.find_first_not_of(" \t\r");
+    if (l == std::string::npos) return {};
+    const size_t r = line.find_last_not_of(" \t\r");
+    return line.substr(l, r - l + 1);
 }
 
-static std::string buildMinimalProfile(const std::string& goal) {
-    // Keep it tiny; extend with more fields as you like.
-    return std::string("{\"goal\":\"") + goal +
-           "\",\"horizon_weeks\":8,\"sessions_per_week\":4}";
+// Line-delimited JSON loop. Each input line is either a profile JSON object or a
+// bare goal string; each output line is {"id":n,"ms":t,"plan":{...}}. With
+// stream=true, {"id":n,"delta":"..."} and {"id":n,"week":i,"data":{...}} lines
+// precede the final one. ":stats" answers {"stats":{...}} and ":metrics" the
+// Prometheus text followed by a blank line. ":swap PATH" starts loading another
+// model and answers {"swap":"PATH"} at once; later lines move over to it when
+// it is ready (see stderr), without a pause in serving.
+static int serve(const lw::GenParams& gp, bool stream) {
+    std::ios::sync_with_stdio(false);
+    std::cerr << "[serve] ready\n";
+
+    std::string line;
+    for (long id = 1; std::getline(std::cin, line); ++id) {
+        const std::string in = trimmed(line);
+        if (in.empty()) { --id; continue; }
+        if (in == ":stats")   { std::cout << "{\"stats\":" << core::metricsJson() << "}\n" << std::flush; --id; continue; }
+        if (in == ":metrics") { std::cout << core::metricsPrometheus() << "\n" << std::flush; --id; continue; }
+        if (in.compare(0, 6, ":swap ") == 0) {
+            const std::string path = trimmed(in.substr(6));
+            core::swapModel(path);   // completion is logged; the future doesn't block
+            std::cout << "{\"swap\":\"" << jsonutil::escape(path) << "\"}\n" << std::flush;
+            --id;
+            continue;
+        }
+        const std::string profile = (in[0] == '{') ? in : prompt::minimalProfile(in);
+
+        const auto t0 = std::chrono::steady_clock::now();
+        std::string plan;
+        std::string err;
+        try {
+            if (stream) {
+                core::StreamHandlers h;
+                h.on_piece = [&](const std::string& piece) {
+                    std::cout << "{\"id\":" << id << ",\"delta\":\"" << jsonutil::escape(piece) << "\"}\n" << std::flush;
+                    return true;
+                };
+                h.on_week = [&](int week, const std::string& data) {
+                    std::cout << "{\"id\":" << id << ",\"week\":" << week << ",\"data\":" << data << "}\n" << std::flush;
+                };
+                plan = core::generatePlanStream(profile, gp, h);
+            } else {
+                plan = core::generatePlan(profile, gp);
+            }
+        } catch (const std::exception& e) {
+            err = e.what();
+        }
+        const double ms = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - t0).count();
+
+        std::cout << "{\"id\":" << id << ",\"ms\":" << ms;
+        if (err.empty()) std::cout << ",\"plan\":" << plan;
+        else             std::cout << ",\"error\":\"" << jsonutil::escape(err) << "\"";
+        std::cout << "}\n" << std::flush;
+        std::cerr << "[serve] id=" << id << " ms=" << ms << "\n";
+    }
+    return 0;
+}
+
+// Offline mode: same input lines as serve, read `chunk` at a time so memory stays
+// bounded. Each chunk is sorted by length (similar prompts prefill and finish
+// together), split across the pooled contexts, run through the batching engine,
+// and written back in input order as {"id":n,"plan":{...}}.
+static int batch(const std::string& in_path, const std::string& out_path, const lw::GenParams& gp,
+                 size_t chunk, int n_contexts) {
+    std::ifstream in(in_path);
+    if (!in) { std::cerr << "[batch] cannot open " << in_path << "\n"; return 1; }
+    std::ofstream out(out_path, std::ios::trunc);
+    if (!out) { std::cerr << "[batch] cannot write " << out_path << "\n"; return 1; }
+
+    std::vector<long>        ids;
+    std::vector<std::string> profiles;
+    std::vector<std::string> plans;
+    std::vector<size_t>      order;
+    long   line_no = 0;
+    size_t done    = 0;
+    bool   failed  = false;
+    const auto t0  = std::chrono::steady_clock::now();
+
+    auto flush = [&]() {
+        const size_t n = profiles.size();
+        order.resize(n);
+        std::iota(order.begin(), order.end(), size_t(0));
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t a, size_t b) { return profiles[a].size() < profiles[b].size(); });
+        plans.assign(n, std::string());
+
+        // contiguous runs of the sorted order, one per context
+        const size_t groups = std::min(n, (size_t)std::max(1, n_contexts));
+        std::vector<std::string> errs(groups);
+        std::vector<std::thread> workers;
+        for (size_t g = 0; g < groups; ++g) {
+            workers.emplace_back([&, g]() {
+                const size_t b = n * g / groups, e = n * (g + 1) / groups;
+                std::vector<std::string> group;
+                for (size_t k = b; k < e; ++k) group.push_back(profiles[order[k]]);
+                try {
+                    std::vector<std::string> res = core::generatePlans(group, gp);
+                    for (size_t k = b; k < e; ++k) plans[order[k]] = std::move(res[k - b]);
+                } catch (const std::exception& ex) {
+                    errs[g] = ex.what();
+                }
+            });
+        }
+        for (std::thread& w : workers) w.join();
+        for (const std::string& e : errs)
+            if (!e.empty()) { std::cerr << "[batch] " << e << "\n"; failed = true; }
+
+        for (size_t i = 0; i < n; ++i) {
+            out << "{\"id\":" << ids[i];
+            if (!plans[i].empty()) out << ",\"plan\":" << plans[i];
+            else                   out << ",\"error\":\"generation failed\"";
+            out << "}\n";
+        }
+        out.flush();
+        done += n;
+        const double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cerr << "[batch] " << done << " plans in " << s << " s (" << (s > 0 ? done / s : 0.0) << "/s)\n";
+        ids.clear();
+        profiles.clear();
+    };
+
+    std::string line;
+    while (std::getline(in, line)) {
+        ++line_no;
+        const std::string req = trimmed(line);
+        if (req.empty()) continue;
+        ids.push_back(line_no);
+        profiles.push_back(req[0] == '{' ? req : prompt::minimalProfile(req));
+        if (profiles.size() >= chunk) flush();
+    }
+    if (!profiles.empty()) flush();
+    return (failed || !out) ? 1 : 0;
+}
+
+static void logStats() {
+    const lw::SpecStats s = core::speculationStats();
+    if (s.drafted > 0)
+        std::cerr << "[spec] drafted=" << s.drafted << " accepted=" << s.accepted
+                  << " acceptance=" << s.acceptance() << "\n";
+    const plancache::Stats c = core::cacheStats();
+    if (c.hits + c.misses > 0)
+        std::cerr << "[cache] hits=" << c.hits << " (disk " << c.disk_hits << ") misses=" << c.misses
+                  << " entries=" << c.entries << " evictions=" << c.evictions << "\n";
+    std::cerr << "[metrics] " << core::metricsJson() << "\n";
 }
 
 int main(int argc, char** argv) {
     if (argc < 2) {
-        std::cout << "Usage: ./workout <path_to_model.gguf>\n";
+        std::cout << "Usage: ./workout <path_to_model.gguf> [--serve [--stream] | --batch IN.jsonl OUT.jsonl [--batch-chunk N]]\n"
+                     "       [--parallel N] [--no-grammar]\n"
+                     "       [--temp T] [--top-k K] [--top-p P] [--repeat-penalty R] [--seed S]\n"
+                     "       [--ctx N|0 [--ctx-gen N] [--kv-mem MB]] [--kv-type f16|q8_0|q4_0] [--flash-attn]\n"
+                     "       [--builtin-template]\n"
+                     "       [--gpu-layers N|all|auto] [--split-mode none|layer|row] [--main-gpu N] [--tensor-split 3,1]\n"
+                     "       [--batch-size N] [--contexts N] [--threads N]\n"
+                     "       [--threads-batch N] [--numa distribute|isolate|numactl|mirror] [--pin CPU_LIST] [--mlock]\n"
+                     "       [--draft DRAFT.gguf [--draft-n K]] [--lookup K] [--cache-entries N] [--cache-dir DIR]\n"
+                     "       [--session FILE] [--debug 0|1|2]\n";
         return 0;
     }
     const std::string model_path = argv[1];
+    bool serve_mode = false;
+    bool stream     = false;
+    bool grammar    = true;
+    std::string batch_in, batch_out;
+    size_t      batch_chunk = 0;
+    core::Options opt;
+    lw::GenParams gp;
+    gp.max_tokens = 512;
+    for (int i = 2; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a == "--serve") serve_mode = true;
+        else if (a == "--stream") stream = true;
+        else if (a == "--batch" && i + 2 < argc)       { batch_in = argv[++i]; batch_out = argv[++i]; }
+        else if (a == "--batch-chunk" && i + 1 < argc) batch_chunk = (size_t)std::max(1, std::atoi(argv[++i]));
+        else if (a == "--no-grammar") grammar = false;
+        else if (a == "--mlock") opt.use_mlock = true;
+        else if (a == "--parallel" && i + 1 < argc)      opt.n_parallel      = std::max(1, std::atoi(argv[++i]));
+        else if (a == "--ctx" && i + 1 < argc)           opt.n_ctx           = std::atoi(argv[++i]);   // 0 / auto
+        else if (a == "--ctx-gen" && i + 1 < argc)       opt.ctx_gen_tokens  = std::max(1, std::atoi(argv[++i]));
+        else if (a == "--kv-mem" && i + 1 < argc)        opt.kv_mem_mb       = (size_t)std::max(0, std::atoi(argv[++i]));
+        else if (a == "--flash-attn")                    opt.flash_attn      = true;
+        else if (a == "--builtin-template")              opt.chat_template   = false;
+        else if (a == "--kv-type" && i + 1 < argc) {
+            const std::string t = argv[++i];
+            if      (t == "f16")  opt.kv_type = lw::KvType::F16;
+            else if (t == "q8_0") opt.kv_type = lw::KvType::Q8_0;
+            else if (t == "q4_0") opt.kv_type = lw::KvType::Q4_0;
+            else std::cerr << "[warn] unknown --kv-type " << t << "; using f16\n";
+        }
+        else if (a == "--gpu-layers" && i + 1 < argc) {
+            if (!lw::parseGpuLayers(argv[++i], opt.n_gpu_layers)) {
+                std::cerr << "bad --gpu-layers value '" << argv[i] << "' (N, all or auto)\n"; return 1;
+            }
+        }
+        else if (a == "--main-gpu" && i + 1 < argc)      opt.main_gpu        = std::max(0, std::atoi(argv[++i]));
+        else if (a == "--tensor-split" && i + 1 < argc)  opt.tensor_split    = argv[++i];
+        else if (a == "--split-mode" && i + 1 < argc) {
+            const std::string m = argv[++i];
+            if (m == "none")       opt.split_mode = lw::SplitMode::None;
+            else if (m == "layer") opt.split_mode = lw::SplitMode::Layer;
+            else if (m == "row")   opt.split_mode = lw::SplitMode::Row;
+            else std::cerr << "[warn] unknown --split-mode '" << m << "'; ignoring\n";
+        }
+        else if (a == "--batch-size" && i + 1 < argc)    opt.n_batch         = std::atoi(argv[++i]);
+        else if (a == "--contexts" && i + 1 < argc)      opt.n_contexts      = std::max(1, std::atoi(argv[++i]));
+        else if (a == "--threads" && i + 1 < argc)       opt.n_threads       = std::atoi(argv[++i]);
+        else if (a == "--threads-batch" && i + 1 < argc) opt.n_threads_batch = std::atoi(argv[++i]);
+        else if (a == "--pin" && i + 1 < argc)           opt.cpus            = argv[++i];
+        else if (a == "--draft" && i + 1 < argc)         opt.draft_model_path = argv[++i];
+        else if (a == "--draft-n" && i + 1 < argc)       opt.n_draft          = std::max(1, std::atoi(argv[++i]));
+        else if (a == "--lookup" && i + 1 < argc)        opt.n_lookup         = std::max(0, std::atoi(argv[++i]));
+        else if (a == "--cache-entries" && i + 1 < argc) opt.cache_entries    = (size_t)std::max(0, std::atoi(argv[++i]));
+        else if (a == "--cache-dir" && i + 1 < argc)     opt.cache_dir        = argv[++i];
+        else if (a == "--session" && i + 1 < argc)       opt.session_path     = argv[++i];
+        else if (a == "--debug" && i + 1 < argc)         opt.debug_level      = std::max(0, std::atoi(argv[++i]));
+        else if (a == "--numa" && i + 1 < argc) {
+            const std::string m = argv[++i];
+            if (m == "distribute")   opt.numa = lw::Numa::Distribute;
+            else if (m == "isolate") opt.numa = lw::Numa::Isolate;
+            else if (m == "numactl") opt.numa = lw::Numa::Numactl;
+            else if (m == "mirror")  opt.numa = lw::Numa::Mirror;
+            else std::cerr << "[warn] unknown --numa mode '" << m << "'; ignoring\n";
+        }
+        else if (a == "--temp" && i + 1 < argc)           gp.sampling.temperature    = (float)std::atof(argv[++i]);
+        else if (a == "--top-k" && i + 1 < argc)          gp.sampling.top_k          = std::atoi(argv[++i]);
+        else if (a == "--top-p" && i + 1 < argc)          gp.sampling.top_p          = (float)std::atof(argv[++i]);
+        else if (a == "--repeat-penalty" && i + 1 < argc) gp.sampling.repeat_penalty = (float)std::atof(argv[++i]);
+        else if (a == "--seed" && i + 1 < argc)           gp.sampling.seed           = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+    }
 
-    if (!core::init(model_path, /*n_ctx*/2048, /*n_gpu_layers*/0)) {
+    if (!core::init(model_path, opt)) {
         std::cerr << "Model init failed.\n"; return 1;
     }
+    if (!grammar) core::setConstrainedDecoding(false);
+
+    if (!batch_in.empty()) {
+        // default: enough to keep every slot of every context busy for a few rounds
+        if (!batch_chunk) batch_chunk = (size_t)std::max(16, 4 * opt.n_parallel * opt.n_contexts);
+        const int rc = batch(batch_in, batch_out, gp, batch_chunk, opt.n_contexts);
+        logStats();
+        core::shutdown();
+        return rc;
+    }
+
+    if (serve_mode) {
+        const int rc = serve(gp, stream);
+        logStats();
+        core::shutdown();
+        return rc;
+    }
 
     std::cout << "Enter goal (e.g., \"5K under 25:00\"): ";
     std::string goal; std::getline(std::cin, goal);
 
-    const std::string profile = buildMinimalProfile(goal);
-    const std::string plan    = core::generatePlan(profile, /*max_tokens*/512);
+    const std::string profile = prompt::minimalProfile(goal);
+    const std::string plan    = core::generatePlan(profile, gp);
 
     std::cout << "\n=== Training Plan (JSON) ===\n" << plan << "\n";
 
+    logStats();
     core::shutdown();
     return 0;
 }
@@ -0,0 +1,236 @@
+// core_tests.cpp - checks for the parts of workout_core that need no model
+// (JsonUtil, Domain, lw option parsing)
+// Run through CTest; exits non-zero if any check fails.
+#include "Domain.h"
+#include "JsonUtil.h"
+#include "LlamaWrapper.h"
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+static int g_failed = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++g_failed; } } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { const std::string a_ = (a), b_ = (b); \
+         if (a_ != b_) { std::fprintf(stderr, "%s:%d: %s\n  got:      %s\n  expected: %s\n", \
+                                      __FILE__, __LINE__, #a, a_.c_str(), b_.c_str()); ++g_failed; } } while (0)
+
+// ---- extractFirstJson ----
+
+static void test_extract() {
+    using jsonutil::extractFirstJson;
+    CHECK_EQ(extractFirstJson("{\"a\":1}"), "{\"a\":1}");
+    CHECK_EQ(extractFirstJson("```json\n{\"a\":[1,2]}\n```\nHope this helps!"), "{\"a\":[1,2]}");
+    CHECK_EQ(extractFirstJson("Sure! {\"a\":[1,{\"b\":\"x"), "{\"a\":[1,{\"b\":\"x\"}]}");
+    CHECK_EQ(extractFirstJson("{\"a\":\"x\\"), "{\"a\":\"x\"}");           // cut inside an escape
+    CHECK_EQ(extractFirstJson("{\"a\":[1,2,],}"), "{\"a\":[1,2]}");
+    CHECK_EQ(extractFirstJson("{\"a\":\"[1,}\",}"), "{\"a\":\"[1,}\"}");  // brackets in strings kept
+
+    // Truncated deeper than the fixed bracket stack still gets the right closers.
+    for (int depth : { 127, 128, 129, 300 }) {
+        std::string deep = "{\"a\":";
+        for (int i = 1; i < depth; ++i) deep += (i % 3 == 0) ? "{\"k\":" : "[";
+        const std::string fixed = extractFirstJson(deep + "1,");
+        CHECK(jsonutil::looksLikeJson(fixed));
+        CHECK_EQ(fixed.substr(0, deep.size() + 1), deep + "1");
+        CHECK(fixed.size() == deep.size() + 1 + (size_t)depth);
+    }
+
+    // The out-param form reuses the buffer and gives the same answer.
+    std::string out = "stale";
+    jsonutil::extractFirstJson("x {\"b\":[],} y", out);
+    CHECK_EQ(out, "{\"b\":[]}");
+}
+
+// ---- strings across the 16-byte scan blocks ----
+
+struct LastString : jsonutil::JsonHandler {
+    std::string raw;
+    bool string(std::string_view s) override { raw.assign(s); return true; }
+};
+
+// Escapes land in every position relative to the 16-byte SIMD blocks, and in
+// the byte-by-byte tail that finishes each string on every build.
+static void test_string_blocks() {
+    const std::string_view escapes[]  = { "\\\"", "\\\\", "\\n", "\\u00e9", "\\ud83d\\ude00" };
+    const std::string_view decoded[]  = { "\"", "\\", "\n", "\xC3\xA9", "\xF0\x9F\x98\x80" };
+    for (size_t e = 0; e < sizeof(escapes) / sizeof(escapes[0]); ++e) {
+        for (size_t pad = 0; pad <= 40; ++pad) {
+            const std::string lead(pad, 'a');
+            const std::string body = lead + std::string(escapes[e]) + "bcdefghijklmnopq" + std::string(escapes[e]);
+            const std::string doc  = "{\"k\":\"" + body + "\"}";
+            LastString h;
+            jsonutil::JsonError err;
+            const bool ok = jsonutil::parseJson(doc, &h, &err);
+            CHECK(ok);
+            if (!ok) { std::fprintf(stderr, "  escape %zu pad %zu: %s\n", e, pad, err.what); continue; }
+            CHECK_EQ(h.raw, body);
+            CHECK_EQ(jsonutil::unescape(h.raw),
+                     lead + std::string(decoded[e]) + "bcdefghijklmnopq" + std::string(decoded[e]));
+        }
+    }
+    // A raw control character is rejected wherever it falls.
+    for (size_t pad = 0; pad <= 40; ++pad) {
+        const std::string doc = "{\"k\":\"" + std::string(pad, 'a') + "\tz\"}";
+        CHECK(!jsonutil::parseJson(doc));
+    }
+    // So is a string that never closes, in a block or in the tail.
+    CHECK(!jsonutil::parseJson("{\"k\":\"abcdefghijklmnopqrstuvwxyz"));
+    CHECK(!jsonutil::parseJson("{\"k\":\"abc\\\"}"));
+}
+
+// ---- nesting limit ----
+
+static std::string nested(int depth) {
+    return std::string((size_t)depth, '[') + std::string((size_t)depth, ']');
+}
+
+static void test_depth() {
+    CHECK(jsonutil::parseJson(nested(512)));
+    jsonutil::JsonError err;
+    CHECK(!jsonutil::parseJson(nested(513), nullptr, &err));
+    CHECK(err.what && std::string_view(err.what) == "nesting too deep");
+}
+
+// ---- other entry points ----
+
+static void test_misc() {
+    CHECK(jsonutil::looksLikeJson("{\"a\":[1,2.5e3,true,null]}"));
+    CHECK(!jsonutil::looksLikeJson("{\"a\":[1,2,]}"));
+    CHECK(!jsonutil::looksLikeJson("[1]"));
+
+    std::string c;
+    CHECK(jsonutil::canonicalize("{ \"b\" : 1, \"a\" : [ 2 , 3 ] }", c));
+    CHECK_EQ(c, "{\"a\":[2,3],\"b\":1}");
+
+    std::string m;
+    CHECK(jsonutil::mergePatch("{\"a\":1,\"b\":2}", "{\"b\":null,\"c\":3}", m));
+    CHECK_EQ(m, "{\"a\":1,\"c\":3}");
+
+    const std::string goal = "5K \"sub-25\"\\\n\x01 caf\xC3\xA9";
+    const std::string esc  = jsonutil::escape(goal);
+    CHECK_EQ(esc, "5K \\\"sub-25\\\"\\\\\\n\\u0001 caf\xC3\xA9");
+    CHECK_EQ(jsonutil::unescape(esc), goal);
+    CHECK(jsonutil::looksLikeJson("{\"goal\":\"" + esc + "\"}"));
+}
+
+// ---- Domain rules ----
+
+static std::string session(const domain::Plan& p, size_t week, size_t i) {
+    return std::string(p.str(p.sessions[p.weeks[week].first + i].text));
+}
+
+static bool has_adjustment(const domain::Plan& p, std::string_view text) {
+    for (const std::string& a : p.adjustments) if (a == text) return true;
+    return false;
+}
+
+static void test_progression_cap() {
+    domain::Plan p;
+    CHECK(domain::parsePlan(
+        "{\"goal\":\"10k\",\"weeks\":["
+        "{\"week\":1,\"sessions\":[\"Mon: easy run 5 km\",\"Wed: tempo 30 min\"]},"
+        "{\"week\":2,\"sessions\":[\"Mon: easy run 8 km\",\"Wed: tempo 40 min\"]}],"
+        "\"rest_days\":[\"Sun\"]}", p));
+    domain::applyRules(p, domain::Profile());
+    // 60 -> 88 min-equivalent is +47%; scaled back to +10% (66).
+    CHECK_EQ(session(p, 1, 0), "Mon: easy run 6 km");
+    CHECK_EQ(session(p, 1, 1), "Wed: tempo 30 min");
+    CHECK(has_adjustment(p, "week 2: progression capped at +10% (was +47%)"));
+    CHECK_EQ(session(p, 0, 0), "Mon: easy run 5 km");   // week 1 untouched
+}
+
+static void test_progression_cap_range() {
+    domain::Plan p;
+    CHECK(domain::parsePlan(
+        "{\"goal\":\"10k\",\"weeks\":["
+        "{\"week\":1,\"sessions\":[\"Mon: easy run 10 km\"]},"
+        "{\"week\":2,\"sessions\":[\"Mon: easy run 12-14 km\"]},"
+        "{\"week\":3,\"sessions\":[\"Mon: easy run 10-12 km\"]}],"
+        "\"rest_days\":[\"Sun\"]}", p));
+    domain::applyRules(p, domain::Profile());
+    // A range loads at its midpoint (13 km, +30%) and both ends scale together.
+    CHECK_EQ(session(p, 1, 0), "Mon: easy run 10.2-11.8 km");
+    CHECK(has_adjustment(p, "week 2: progression capped at +10% (was +30%)"));
+    CHECK_EQ(session(p, 2, 0), "Mon: easy run 10-12 km");   // 11 km, within the cap of week 2
+    CHECK(p.adjustments.size() == 1);
+}
+
+static void test_deload() {
+    domain::Plan p;
+    CHECK(domain::parsePlan(
+        "{\"goal\":\"10k\",\"weeks\":["
+        "{\"week\":1,\"sessions\":[\"Mon: run 5 km\"]},"
+        "{\"week\":2,\"sessions\":[\"Mon: run 5.5 km\"]},"
+        "{\"week\":3,\"sessions\":[\"Mon: run 6 km\"]},"
+        "{\"week\":4,\"sessions\":[\"Mon: run 6 km\"]}],"
+        "\"rest_days\":[\"Sun\"]}", p));
+    domain::applyRules(p, domain::Profile());
+    CHECK_EQ(session(p, 2, 0), "Mon: run 6 km");        // +9%, within the cap
+    CHECK_EQ(session(p, 3, 0), "Mon: run 4.2 km");      // week 4 deloads to 70%
+    CHECK(has_adjustment(p, "week 4: deload: volume cut to 70% of previous week (was 100%)"));
+    CHECK(p.adjustments.size() == 1);
+}
+
+static void test_injury_swap() {
+    const std::string plan =
+        "{\"goal\":\"10k\",\"weeks\":["
+        "{\"week\":1,\"sessions\":[\"Mon: hill repeats 6x400m\",\"Tue: Crunches 10 min\",\"Thu: rest\"]},"
+        "{\"week\":2,\"sessions\":[\"Mon: tempo run 20 min\",\"Sat: brunch then Chill 10 min\"]}],"
+        "\"rest_days\":[\"Sun\"]}";
+
+    domain::Plan p;
+    CHECK(domain::parsePlan(plan, p));
+    // Week 1 counts as checked; swaps still apply to it. Both weeks load 30, so
+    // nothing but the swap changes.
+    domain::applyRules(p, domain::parseProfile("{\"injuries\":[\"Knee\"]}"), 1);
+    CHECK_EQ(session(p, 0, 0), "Mon: low-impact cross-training (bike or pool) 20 min");
+    CHECK_EQ(session(p, 0, 1), "Tue: Crunches 10 min");   // keywords match at word starts only
+    CHECK_EQ(session(p, 0, 2), "Thu: rest");
+    CHECK_EQ(session(p, 1, 0), "Mon: low-impact cross-training (bike or pool) 20 min");
+    CHECK_EQ(session(p, 1, 1), "Sat: brunch then Chill 10 min");
+    CHECK(has_adjustment(p, "2 high-impact sessions swapped for low-impact work (knee)"));
+    CHECK(p.adjustments.size() == 1);
+
+    // Upper-body injuries leave impact work alone.
+    CHECK(domain::parsePlan(plan, p));
+    domain::applyRules(p, domain::parseProfile("{\"injuries\":[\"left shoulder\"]}"));
+    CHECK_EQ(session(p, 0, 0), "Mon: hill repeats 6x400m");
+    for (const std::string& a : p.adjustments) CHECK(a.find("swapped") == std::string::npos);
+}
+
+// ---- option parsing ----
+
+static void test_gpu_layers() {
+    int n = 7;
+    CHECK(lw::parseGpuLayers("auto", n) && n == lw::kGpuLayersAuto);
+    CHECK(lw::parseGpuLayers("all", n)  && n == lw::kGpuLayersAll);
+    CHECK(lw::parseGpuLayers("12", n)   && n == 12);
+    CHECK(lw::parseGpuLayers("-1", n)   && n == lw::kGpuLayersAll);
+    CHECK(lw::parseGpuLayers("0", n)    && n == 0);
+    // Typos fail and leave the value alone rather than turning on offload.
+    n = 0;
+    for (const char* bad : { "1O", "-1x", "al", "", "-3", "99999999999" }) {
+        CHECK(!lw::parseGpuLayers(bad, n));
+        CHECK(n == 0);
+    }
+}
+
+int main() {
+    test_extract();
+    test_string_blocks();
+    test_depth();
+    test_misc();
+    test_progression_cap();
+    test_progression_cap_range();
+    test_deload();
+    test_injury_swap();
+    test_gpu_layers();
+    if (g_failed) { std::fprintf(stderr, "%d check(s) failed\n", g_failed); return 1; }
+    std::printf("core_tests: all checks passed\n");
+    return 0;
+}